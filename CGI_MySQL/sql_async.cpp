@@ -0,0 +1,583 @@
+#include <cstdio>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <mysql/errmsg.h>
+#include "sql_async.h"
+#include "../log/log.h"
+
+sql_async::sql_async() : m_epollfd(-1), m_eventfd(-1), m_running(false), m_stop(false), m_port(0) {}
+
+sql_async::~sql_async() {
+    // 数据库线程还在运行时先让它退出，否则它会访问下面释放的连接
+    stop();
+    for (size_t i = 0; i < m_conns.size(); ++i) {
+        mysql_close(m_conns[i].mysql);
+#ifdef SQL_ASYNC_MARIADB
+        close_stmts(&m_conns[i]);
+#endif
+    }
+    if (m_epollfd != -1) close(m_epollfd);
+    if (m_eventfd != -1) close(m_eventfd);
+}
+
+// 局部静态变量单例模式
+sql_async* sql_async::GetInstance() {
+    static sql_async sqlAsync;
+    return &sqlAsync;
+}
+
+bool sql_async::init(string url, string user, string password, string databasename, int port, int conn_num) {
+#if !defined(SQL_ASYNC_MARIADB) && !defined(SQL_ASYNC_MYSQL8)
+    LOG_INFO("%s", "mysql client library has no nonblocking API, register uses synchronous queries");
+    return false;
+#else
+    if (conn_num <= 0) return false;
+    m_url = url;
+    m_user = user;
+    m_password = password;
+    m_databasename = databasename;
+    m_port = port;
+    m_epollfd = epoll_create(5);
+    m_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_epollfd == -1 || m_eventfd == -1) return false;
+
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(m_epollfd, EPOLL_CTL_ADD, m_eventfd, &event);
+
+    // 先预留空间，保证注册到epoll上的conn_ctx指针不会因扩容而失效
+    m_conns.reserve(conn_num);
+    for (int i = 0; i < conn_num; ++i) {
+        MYSQL *conn = mysql_init(NULL);
+        if (!conn) return false;
+#ifdef SQL_ASYNC_MARIADB
+        // 开启非阻塞模式后阻塞接口仍然可用，启动时直接阻塞地建立连接
+        mysql_options(conn, MYSQL_OPT_NONBLOCK, 0);
+        if (!mysql_real_connect(conn, url.c_str(), user.c_str(), password.c_str(), databasename.c_str(), port, NULL, 0)) {
+#else
+        // MySQL 8的非阻塞查询要求连接也由非阻塞接口建立，启动时轮询到连接完成即可
+        enum net_async_status status;
+        while ((status = mysql_real_connect_nonblocking(conn, url.c_str(), user.c_str(), password.c_str(),
+                                                        databasename.c_str(), port, NULL, 0)) == NET_ASYNC_NOT_READY)
+            usleep(1000);
+        if (status == NET_ASYNC_ERROR) {
+#endif
+            LOG_ERROR("sql_async connect error:%s", mysql_error(conn));
+            mysql_close(conn);
+            return false;
+        }
+
+        conn_ctx c;
+        c.mysql = conn;
+        c.fd = socket_of(conn);
+        c.busy = false;
+        c.connecting = false;
+        c.reconnected = false;
+        c.err = 0;
+#ifdef SQL_ASYNC_MARIADB
+        c.stmt = NULL;
+        c.preparing = false;
+#endif
+        m_conns.push_back(c);
+        m_idle.push_back(&m_conns.back());
+
+        // 空闲连接只注册EPOLLONESHOT，服务端关闭空闲连接时不会反复触发EPOLLHUP
+        event.events = EPOLLONESHOT;
+        event.data.ptr = &m_conns.back();
+        epoll_ctl(m_epollfd, EPOLL_CTL_ADD, c.fd, &event);
+    }
+
+    // 不分离线程，退出时由stop回收
+    if (pthread_create(&m_tid, NULL, worker, this) != 0) return false;
+    m_running = true;
+    return true;
+#endif
+}
+
+void sql_async::stop() {
+    // 在锁内清除标志，之后的submit*都返回false，不会有查询在fail_all之后才进入等待队列
+    m_lock.lock();
+    bool running = m_running;
+    m_running = false;
+    m_lock.unlock();
+    if (!running) return;
+    m_stop = true;
+    unsigned long long one = 1;
+    write(m_eventfd, &one, sizeof(one));
+    pthread_join(m_tid, NULL);
+    fail_all(CR_UNKNOWN_ERROR);
+}
+
+void sql_async::fail_all(int err) {
+    for (size_t i = 0; i < m_conns.size(); ++i) {
+        conn_ctx *c = &m_conns[i];
+        if (!c->busy) continue;
+        if (c->rows.empty()) c->q.cb(c->q.arg, err);
+        for (size_t j = c->retry < 0 ? 0 : c->retry; j < c->rows.size(); ++j) c->rows[j].cb(c->rows[j].arg, err);
+        c->busy = false;
+        c->rows.clear();
+    }
+    list<query> pending;
+    list<insert_row> pending_rows;
+    m_lock.lock();
+    pending.swap(m_pending);
+    pending_rows.swap(m_pending_rows);
+    m_lock.unlock();
+    for (list<query>::iterator it = pending.begin(); it != pending.end(); ++it) it->cb(it->arg, err);
+    for (list<insert_row>::iterator it = pending_rows.begin(); it != pending_rows.end(); ++it) it->cb(it->arg, err);
+}
+
+bool sql_async::submit(const string &sql, callback cb, void *arg) {
+    if (!m_running) return false;
+    query q;
+    q.sql = sql;
+    q.cb = cb;
+    q.arg = arg;
+    m_lock.lock();
+    // 与stop互斥，stop之后入队的查询不会再被执行或回调
+    if (!m_running) {
+        m_lock.unlock();
+        return false;
+    }
+    m_pending.push_back(q);
+    m_lock.unlock();
+
+    unsigned long long one = 1;
+    write(m_eventfd, &one, sizeof(one));
+    return true;
+}
+
+bool sql_async::submit_insert(const string &into, const vector<string> &values, callback cb, void *arg) {
+    if (!m_running) return false;
+    insert_row row;
+    row.into = into;
+    row.values = values;
+    row.cb = cb;
+    row.arg = arg;
+    row.stamp = now_us();
+    m_lock.lock();
+    if (!m_running) {
+        m_lock.unlock();
+        return false;
+    }
+    m_pending_rows.push_back(row);
+    // 只有队列中的第一行（数据库线程据此设置凑批的等待时间）和凑满一批时需要唤醒数据库线程
+    bool wake = m_pending_rows.size() == 1 || m_pending_rows.size() == SQL_ASYNC_MAX_BATCH;
+    m_lock.unlock();
+
+    if (wake) {
+        unsigned long long one = 1;
+        write(m_eventfd, &one, sizeof(one));
+    }
+    return true;
+}
+
+void *sql_async::worker(void *arg) {
+    sql_async *sqlAsync = (sql_async *)arg;
+    sqlAsync->run();
+    return sqlAsync;
+}
+
+void sql_async::run() {
+    epoll_event events[SQL_ASYNC_MAX_EVENTS];
+    int timeout = SQL_ASYNC_RETRY_MS;
+    while (!m_stop) {
+        int number = epoll_wait(m_epollfd, events, SQL_ASYNC_MAX_EVENTS, timeout);
+        if (number < 0 && errno != EINTR) {
+            LOG_ERROR("%s", "sql_async epoll failure");
+            break;
+        }
+        for (int i = 0; i < number; ++i) {
+            conn_ctx *c = (conn_ctx *)events[i].data.ptr;
+            if (!c) {
+                unsigned long long cnt;
+                read(m_eventfd, &cnt, sizeof(cnt));
+            } else if (c->busy) {
+                step(c, events[i].events);
+            }
+        }
+#ifdef SQL_ASYNC_MYSQL8
+        // 超时时重试所有执行中的查询，覆盖请求报文没有一次发送完、需要等待可写的情况
+        if (number == 0) {
+            for (size_t i = 0; i < m_conns.size(); ++i) {
+                if (m_conns[i].busy) step(&m_conns[i], 0);
+            }
+        }
+#endif
+        // 有插入在凑批时，最多等到这一批到期
+        int wait = dispatch();
+        timeout = wait >= 0 && wait < SQL_ASYNC_RETRY_MS ? wait : SQL_ASYNC_RETRY_MS;
+    }
+}
+
+int sql_async::dispatch() {
+    while (!m_idle.empty()) {
+        conn_ctx *c = m_idle.back();
+        m_lock.lock();
+        if (!m_pending.empty()) {
+            c->q = m_pending.front();
+            m_pending.pop_front();
+            c->sql.swap(c->q.sql);
+        } else if (!m_pending_rows.empty()) {
+            // 没凑满一批且最早的一行还没等够时先不执行，让后面的插入合并进来
+            long wait = m_pending_rows.front().stamp + SQL_ASYNC_BATCH_US - now_us();
+            if (m_pending_rows.size() < SQL_ASYNC_MAX_BATCH && wait > 0) {
+                m_lock.unlock();
+                return (wait + 999) / 1000;
+            }
+            // 取出与第一行插入同一张表的行
+            string into = m_pending_rows.front().into;
+            for (list<insert_row>::iterator it = m_pending_rows.begin();
+                 it != m_pending_rows.end() && c->rows.size() < SQL_ASYNC_MAX_BATCH; ) {
+                if (it->into == into) {
+                    c->rows.push_back(*it);
+                    it = m_pending_rows.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        } else {
+            m_lock.unlock();
+            return -1;
+        }
+        m_lock.unlock();
+        m_idle.pop_back();
+        c->reconnected = false;
+        if (!c->rows.empty()) {
+            c->retry = -1;
+            build_insert(c, 0, c->rows.size());
+        }
+        // 在锁外执行，查询立即完成时回调函数可能再次提交查询
+        start(c);
+    }
+    return -1;
+}
+
+void sql_async::build_insert(conn_ctx *c, size_t begin, size_t end) {
+    c->sql = "INSERT INTO " + c->rows[begin].into + " VALUES ";
+#ifdef SQL_ASYNC_MARIADB
+    // 同一张表、同样行数的语句文本相同，可以作为预处理语句的缓存键
+    c->first = begin;
+    c->last = end;
+    string row = "(";
+    for (size_t j = 0; j < c->rows[begin].values.size(); ++j) row += j ? ", ?" : "?";
+    row += ')';
+    for (size_t i = begin; i < end; ++i) {
+        if (i != begin) c->sql += ", ";
+        c->sql += row;
+    }
+#else
+    vector<char> buf;
+    for (size_t i = begin; i < end; ++i) {
+        c->sql += i == begin ? "(" : ", (";
+        const vector<string> &values = c->rows[i].values;
+        for (size_t j = 0; j < values.size(); ++j) {
+            // 按连接的字符集转义引号、反斜杠等字符，最坏情况下长度翻倍
+            buf.resize(values[j].size() * 2 + 1);
+            unsigned long len = mysql_real_escape_string(c->mysql, &buf[0], values[j].c_str(), values[j].size());
+            if (j) c->sql += ", ";
+            c->sql += '\'';
+            c->sql.append(&buf[0], len);
+            c->sql += '\'';
+        }
+        c->sql += ')';
+    }
+#endif
+}
+
+void sql_async::start(conn_ctx *c) {
+    c->busy = true;
+    // 上次重连没有成功，连接不可用，先重连
+    if (c->fd < 0) {
+        c->err = CR_SERVER_GONE_ERROR;
+        reconnect(c);
+        return;
+    }
+#ifdef SQL_ASYNC_MARIADB
+    if (!c->rows.empty()) {
+        start_stmt(c);
+        return;
+    }
+    int ret = 0;
+    int status = mysql_real_query_start(&ret, c->mysql, c->sql.c_str(), c->sql.size());
+    if (status) {
+        wait_for(c, wait_events(status));
+        return;
+    }
+    finish(c, ret ? mysql_errno(c->mysql) : 0);
+#else
+    step(c, 0);
+#endif
+}
+
+void sql_async::step(conn_ctx *c, int events) {
+    if (c->connecting) {
+        connect_step(c, events);
+        return;
+    }
+#ifdef SQL_ASYNC_MARIADB
+    int ret = 0, status;
+    if (c->stmt) {
+        // 参数的求值顺序不确定，先取得status，ret才是本次调用写入的值
+        if (c->preparing) status = mysql_stmt_prepare_cont(&ret, c->stmt, ready_status(events));
+        else status = mysql_stmt_execute_cont(&ret, c->stmt, ready_status(events));
+        stmt_step(c, status, ret);
+        return;
+    }
+    status = mysql_real_query_cont(&ret, c->mysql, ready_status(events));
+    if (status) {
+        wait_for(c, wait_events(status));
+        return;
+    }
+    finish(c, ret ? mysql_errno(c->mysql) : 0);
+#elif defined(SQL_ASYNC_MYSQL8)
+    enum net_async_status status = mysql_real_query_nonblocking(c->mysql, c->sql.c_str(), c->sql.size());
+    if (status == NET_ASYNC_NOT_READY) {
+        // 接口不区分在等读还是等写，绝大多数情况是语句已发出、在等服务端的响应，注册读事件，等待可写的情况由超时重试覆盖
+        wait_for(c, EPOLLIN);
+        return;
+    }
+    finish(c, status == NET_ASYNC_ERROR ? mysql_errno(c->mysql) : 0);
+#endif
+}
+
+void sql_async::finish(conn_ctx *c, int err) {
+    // 断线时重连并把当前语句重新执行一次，否则这条连接之后的每条语句都会失败
+    if ((err == CR_SERVER_GONE_ERROR || err == CR_SERVER_LOST) && !c->reconnected) {
+        c->err = err;
+        reconnect(c);
+        return;
+    }
+    if (err) LOG_ERROR("sql_async query error:%s", mysql_error(c->mysql));
+    if (c->rows.empty()) {
+        c->q.cb(c->q.arg, err);
+    } else if (c->retry < 0 && err && c->rows.size() > 1) {
+        // 整批失败可能只是其中一行的问题（如用户名重复），逐行重新执行，连接继续占用
+        c->retry = 0;
+        build_insert(c, 0, 1);
+        start(c);
+        return;
+    } else if (c->retry < 0) {
+        for (size_t i = 0; i < c->rows.size(); ++i) c->rows[i].cb(c->rows[i].arg, err);
+    } else {
+        c->rows[c->retry].cb(c->rows[c->retry].arg, err);
+        if (++c->retry < (int)c->rows.size()) {
+            build_insert(c, c->retry, c->retry + 1);
+            start(c);
+            return;
+        }
+    }
+    c->busy = false;
+    c->sql.clear();
+    c->rows.clear();
+    m_idle.push_back(c);
+}
+
+long sql_async::now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+void sql_async::wait_for(conn_ctx *c, int events) {
+    epoll_event event;
+    event.events = events | EPOLLONESHOT;
+    event.data.ptr = c;
+    epoll_ctl(m_epollfd, EPOLL_CTL_MOD, c->fd, &event);
+}
+
+int sql_async::socket_of(MYSQL *conn) {
+#ifdef SQL_ASYNC_MARIADB
+    return mysql_get_socket(conn);
+#else
+    return conn->net.fd;
+#endif
+}
+
+void sql_async::reconnect(conn_ctx *c) {
+    LOG_ERROR("sql_async connection lost:%s, reconnecting", mysql_error(c->mysql));
+    c->reconnected = true;
+    MYSQL *conn = mysql_init(NULL);
+    if (!conn) {
+        finish(c, c->err);
+        return;
+    }
+    if (c->fd >= 0) epoll_ctl(m_epollfd, EPOLL_CTL_DEL, c->fd, NULL);
+    mysql_close(c->mysql);
+#ifdef SQL_ASYNC_MARIADB
+    // 预处理语句属于旧连接，连上后执行插入时重新预处理
+    close_stmts(c);
+#endif
+    c->mysql = conn;
+    c->fd = -1;
+    c->connecting = true;
+#ifdef SQL_ASYNC_MARIADB
+    mysql_options(conn, MYSQL_OPT_NONBLOCK, 0);
+#endif
+    connect_step(c, -1);
+}
+
+void sql_async::connect_step(conn_ctx *c, int events) {
+    int ev = 0;
+#ifdef SQL_ASYNC_MARIADB
+    MYSQL *ret = NULL;
+    int status;
+    if (events < 0) {
+        status = mysql_real_connect_start(&ret, c->mysql, m_url.c_str(), m_user.c_str(), m_password.c_str(),
+                                          m_databasename.c_str(), m_port, NULL, 0);
+    } else {
+        status = mysql_real_connect_cont(&ret, c->mysql, ready_status(events));
+    }
+    if (!status) {
+        connected(c, ret != NULL);
+        return;
+    }
+    ev = wait_events(status);
+#else
+    enum net_async_status status = mysql_real_connect_nonblocking(c->mysql, m_url.c_str(), m_user.c_str(), m_password.c_str(),
+                                                                  m_databasename.c_str(), m_port, NULL, 0);
+    if (status != NET_ASYNC_NOT_READY) {
+        connected(c, status == NET_ASYNC_COMPLETE);
+        return;
+    }
+    // 与查询一样只注册读事件（握手和认证都在等服务端的报文），TCP连接尚未完成等其余情况由超时重试推进
+    ev = EPOLLIN;
+#endif
+    // 新连接的socket第一次出现时注册到epoll上
+    int fd = socket_of(c->mysql);
+    if (fd < 0) return;
+    if (fd != c->fd) {
+        c->fd = fd;
+        epoll_event event;
+        event.events = ev | EPOLLONESHOT;
+        event.data.ptr = c;
+        epoll_ctl(m_epollfd, EPOLL_CTL_ADD, fd, &event);
+    } else {
+        wait_for(c, ev);
+    }
+}
+
+void sql_async::connected(conn_ctx *c, bool ok) {
+    c->connecting = false;
+    if (!ok) {
+        // 连接不上时报告原来的错误，下一条语句执行前再重连
+        LOG_ERROR("sql_async reconnect error:%s", mysql_error(c->mysql));
+        if (c->fd >= 0) epoll_ctl(m_epollfd, EPOLL_CTL_DEL, c->fd, NULL);
+        c->fd = -1;
+        finish(c, c->err);
+        return;
+    }
+    int fd = socket_of(c->mysql);
+    if (fd != c->fd) {
+        if (c->fd >= 0) epoll_ctl(m_epollfd, EPOLL_CTL_DEL, c->fd, NULL);
+        c->fd = fd;
+        epoll_event event;
+        event.events = EPOLLONESHOT;
+        event.data.ptr = c;
+        epoll_ctl(m_epollfd, EPOLL_CTL_ADD, fd, &event);
+    }
+    LOG_INFO("%s", "sql_async reconnected");
+    start(c);
+}
+
+#ifdef SQL_ASYNC_MARIADB
+int sql_async::wait_events(int status) {
+    int ev = 0;
+    if (status & MYSQL_WAIT_READ) ev |= EPOLLIN;
+    if (status & MYSQL_WAIT_WRITE) ev |= EPOLLOUT;
+    if (status & MYSQL_WAIT_EXCEPT) ev |= EPOLLPRI;
+    return ev;
+}
+
+int sql_async::ready_status(int events) {
+    int ready = 0;
+    if (events & EPOLLIN) ready |= MYSQL_WAIT_READ;
+    if (events & EPOLLOUT) ready |= MYSQL_WAIT_WRITE;
+    if (events & EPOLLPRI) ready |= MYSQL_WAIT_EXCEPT;
+    // 连接出错时让客户端库自己去读写，从而得到错误码
+    if (events & (EPOLLERR | EPOLLHUP)) ready |= MYSQL_WAIT_READ | MYSQL_WAIT_WRITE;
+    return ready;
+}
+
+void sql_async::start_stmt(conn_ctx *c) {
+    map<string, MYSQL_STMT*>::iterator it = c->stmts.find(c->sql);
+    if (it != c->stmts.end()) {
+        c->stmt = it->second;
+        execute_stmt(c);
+        return;
+    }
+    c->stmt = mysql_stmt_init(c->mysql);
+    if (!c->stmt) {
+        finish(c, CR_OUT_OF_MEMORY);
+        return;
+    }
+    c->preparing = true;
+    int ret = 0;
+    int status = mysql_stmt_prepare_start(&ret, c->stmt, c->sql.c_str(), c->sql.size());
+    stmt_step(c, status, ret);
+}
+
+void sql_async::execute_stmt(conn_ctx *c) {
+    size_t cols = c->rows[c->first].values.size();
+    c->binds.assign((c->last - c->first) * cols, MYSQL_BIND());
+    c->lengths.resize(c->binds.size());
+    for (size_t i = c->first, k = 0; i < c->last; ++i) {
+        const vector<string> &values = c->rows[i].values;
+        for (size_t j = 0; j < cols; ++j, ++k) {
+            c->lengths[k] = values[j].size();
+            c->binds[k].buffer_type = MYSQL_TYPE_STRING;
+            c->binds[k].buffer = (void *)values[j].c_str();
+            c->binds[k].buffer_length = values[j].size();
+            c->binds[k].length = &c->lengths[k];
+        }
+    }
+    if (mysql_stmt_bind_param(c->stmt, &c->binds[0])) {
+        int err = mysql_stmt_errno(c->stmt);
+        c->stmt = NULL;
+        finish(c, err);
+        return;
+    }
+    int ret = 0;
+    int status = mysql_stmt_execute_start(&ret, c->stmt);
+    stmt_step(c, status, ret);
+}
+
+void sql_async::stmt_step(conn_ctx *c, int status, int ret) {
+    if (status) {
+        wait_for(c, wait_events(status));
+        return;
+    }
+    MYSQL_STMT *stmt = c->stmt;
+    bool prepared = c->preparing;
+    c->preparing = false;
+    if (ret) {
+        int err = mysql_stmt_errno(stmt);
+        LOG_ERROR("sql_async %s error:%s", prepared ? "prepare" : "execute", mysql_stmt_error(stmt));
+        // 预处理失败的语句没有放入缓存，直接释放
+        if (prepared) mysql_stmt_close(stmt);
+        c->stmt = NULL;
+        finish(c, err);
+        return;
+    }
+    if (prepared) {
+        c->stmts[c->sql] = stmt;
+        execute_stmt(c);
+        return;
+    }
+    c->stmt = NULL;
+    finish(c, 0);
+}
+
+void sql_async::close_stmts(conn_ctx *c) {
+    if (c->stmt && c->preparing) mysql_stmt_close(c->stmt);
+    for (map<string, MYSQL_STMT*>::iterator it = c->stmts.begin(); it != c->stmts.end(); ++it) mysql_stmt_close(it->second);
+    c->stmts.clear();
+    c->stmt = NULL;
+    c->preparing = false;
+}
+#endif
@@ -0,0 +1,146 @@
+#ifndef SQL_ASYNC_H
+#define SQL_ASYNC_H
+
+#include <map>
+#include <list>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <mysql/mysql.h>
+#include "../lock/locker.h"
+
+using namespace std;
+
+// 根据客户端库选择非阻塞接口：MariaDB Connector/C提供mysql_real_query_start/_cont，
+// MySQL 8.0.16及以上提供mysql_real_query_nonblocking，都不支持时异步查询不可用，注册请求回退为同步查询
+#if defined(LIBMARIADB) || defined(MARIADB_BASE_VERSION) || defined(MARIADB_PACKAGE_VERSION)
+#define SQL_ASYNC_MARIADB
+#elif defined(MYSQL_VERSION_ID) && MYSQL_VERSION_ID >= 80016
+#define SQL_ASYNC_MYSQL8
+#endif
+
+#define SQL_ASYNC_MAX_EVENTS 64
+#define SQL_ASYNC_RETRY_MS 10   // epoll_wait超时时间，MySQL 8的非阻塞接口不告知等待方向，超时后重试所有执行中的查询
+#define SQL_ASYNC_MAX_BATCH 32  // 一条INSERT语句最多合并的行数
+#define SQL_ASYNC_BATCH_US 1000 // 插入的行最多等待多久凑批
+
+// 异步数据库查询，单例模式
+// 由一个专门的数据库线程管理若干条非阻塞的MySQL连接，连接的socket注册在该线程自己的epoll上，
+// 工作线程提交查询后立即返回去处理其他请求，查询完成时在数据库线程中调用回调函数
+// 每条连接同一时刻只能执行一条语句，提交的查询先放入等待队列，有空闲连接时再取出执行，因此在途的查询数不受连接数限制
+// 只用于不返回结果集的语句（INSERT/UPDATE等）
+// 插入单独排队，同一张表的插入合并成一条多行INSERT（组提交），凑满SQL_ASYNC_MAX_BATCH行或最早的一行等待超过SQL_ASYNC_BATCH_US时执行，
+// 注册高峰时一次往返可以写入多个用户；MariaDB上多行INSERT是按表和行数在每条连接上缓存的预处理语句，插入的值作为参数传给服务端，
+// 只有MySQL 8例外：它的非阻塞接口没有预处理语句，插入的值在执行的连接上转义后拼接，不会被注入
+class sql_async {
+public:
+    // 查询完成后的回调函数，在数据库线程中调用，err为0表示执行成功，否则为mysql_errno
+    typedef void (*callback)(void *arg, int err);
+
+    static sql_async* GetInstance();
+    // 建立conn_num条非阻塞连接并启动数据库线程，客户端库不支持非阻塞接口或连接失败时返回false
+    bool init(string url, string user, string password, string databasename, int port, int conn_num);
+    // 是否可以提交异步查询
+    bool enabled() const {return m_running;}
+    // 提交一条查询，返回false时回调不会被调用
+    bool submit(const string &sql, callback cb, void *arg);
+    // 提交一行插入，into为"表名(列名, ...)"，values为各列的值，执行时作为预处理语句的参数，MySQL 8上转义并加上引号
+    // 多行INSERT执行失败时逐行重新执行，每一行的回调都得到自己的结果
+    bool submit_insert(const string &into, const vector<string> &values, callback cb, void *arg);
+    // 结束并回收数据库线程，还在排队和执行中的查询以CR_UNKNOWN_ERROR调用回调，等待结果的连接不会一直挂着；
+    // 须在回调用到的对象（事件循环）释放之前调用，可重复调用
+    void stop();
+
+private:
+    sql_async();
+    ~sql_async();
+
+    struct query {
+        string sql;
+        callback cb;
+        void *arg;
+    };
+
+    struct insert_row {
+        string into;
+        vector<string> values;
+        callback cb;
+        void *arg;
+        long stamp;                 // 提交时间，微秒
+    };
+
+    // 一条非阻塞连接及其上正在执行的语句
+    struct conn_ctx {
+        MYSQL *mysql;
+        int fd;
+        bool busy;
+        string sql;                 // 正在执行的语句
+        query q;                    // 普通查询，rows为空时有效
+        vector<insert_row> rows;    // 合并执行的插入
+        int retry;                  // 多行INSERT失败后逐行重新执行到的行，-1表示正在执行整批
+        bool connecting;            // 正在非阻塞地重新建立连接
+        bool reconnected;           // 当前语句已经因断线重连过一次，再断线时直接报告错误
+        int err;                    // 触发重连的错误码，重连失败时报告给回调
+#ifdef SQL_ASYNC_MARIADB
+        map<string, MYSQL_STMT*> stmts;     // 以语句文本为键缓存的多行INSERT预处理语句，即每张表每种行数一条，重连时释放
+        MYSQL_STMT *stmt;           // 正在预处理或执行的语句，为NULL时执行的是普通查询
+        bool preparing;             // stmt正在预处理，完成后放入stmts再执行
+        size_t first, last;         // stmt的参数取自rows中[first, last)的行
+        vector<MYSQL_BIND> binds;   // 执行结束前都要保持有效
+        vector<unsigned long> lengths;
+#endif
+    };
+
+    static void *worker(void *arg);
+    void run();
+    // 从等待队列中取出查询交给空闲连接，返回下一批插入还需等待的毫秒数，没有等待的插入时返回-1
+    int dispatch();
+    // 把c->rows中[begin, end)的行拼成一条INSERT语句，存入c->sql；MariaDB上只拼出占位符
+    void build_insert(conn_ctx *c, size_t begin, size_t end);
+    // 在连接c上开始执行其查询
+    void start(conn_ctx *c);
+    // socket就绪后继续执行查询，events为epoll返回的事件
+    void step(conn_ctx *c, int events);
+    // 语句执行结束，调用回调函数并归还连接；多行INSERT失败时改为逐行执行，连接继续占用
+    void finish(conn_ctx *c, int err);
+    static long now_us();
+    // 按非阻塞接口要求的等待方向修改socket在epoll上注册的事件
+    void wait_for(conn_ctx *c, int events);
+    static int socket_of(MYSQL *conn);
+    // 服务端断开了连接（wait_timeout、重启等），关闭旧连接，非阻塞地重新建立，连上后重新执行当前语句
+    void reconnect(conn_ctx *c);
+    // 推进重连，events为-1时发起连接
+    void connect_step(conn_ctx *c, int events);
+    void connected(conn_ctx *c, bool ok);
+    // 数据库线程退出后，以err调用执行中和排队中的所有查询的回调
+    void fail_all(int err);
+#ifdef SQL_ASYNC_MARIADB
+    static int wait_events(int status);
+    static int ready_status(int events);
+    // 取出或预处理c->sql对应的语句，再绑定参数执行
+    void start_stmt(conn_ctx *c);
+    void execute_stmt(conn_ctx *c);
+    // 预处理或执行的一步返回后调用，status非0时继续等待socket
+    void stmt_step(conn_ctx *c, int status, int ret);
+    // 在mysql_close之后调用，此时语句已与连接分离，释放时不再访问服务端
+    static void close_stmts(conn_ctx *c);
+#endif
+
+private:
+    int m_epollfd;
+    int m_eventfd;                  // 工作线程提交查询后通过eventfd唤醒数据库线程
+    std::atomic<bool> m_running;    // 工作线程通过enabled和submit*读取，stop在主线程中修改
+    std::atomic<bool> m_stop;       // 通知数据库线程退出
+    pthread_t m_tid;
+
+    string m_url, m_user, m_password, m_databasename;   // 重连时使用
+    int m_port;
+
+    vector<conn_ctx> m_conns;
+    vector<conn_ctx*> m_idle;       // 空闲连接，只由数据库线程访问
+    locker m_lock;                  // 保护等待队列
+    list<query> m_pending;          // 等待空闲连接的查询
+    list<insert_row> m_pending_rows;    // 等待凑批的插入
+};
+
+#endif
@@ -0,0 +1,280 @@
+#ifndef USER_TABLE_H
+#define USER_TABLE_H
+
+#include <atomic>
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include "../lock/locker.h"
+using namespace std;
+
+#define UT_SHARD_BITS 6
+#define UT_SHARDS (1 << UT_SHARD_BITS)      // 分片数，64
+#define UT_INIT_SLOTS 64                    // 每个分片初始的槽数，必须是2的幂
+#define UT_CACHELINE 64
+#define UT_READER_STRIPES 64                // 读者计数的分条数，每个线程固定使用其中一条
+#define UT_RECLAIM_BATCH 32                 // 退役的表项攒够这么多再回收一次
+
+// 用户名和密码的缓存表，取代原来的全局map<string, string> + 互斥锁m_lock
+// 按用户名的哈希值分成64个分片，每个分片是一个线性探测的开放寻址哈希表，槽中只存放指向表项的指针
+// 读（登录校验）不加锁：表项写入后不再修改，通过release语义存入槽中，槽数组也通过原子指针发布，读者按acquire语义读取即可看到完整的内容
+// 写（注册）只锁用户名所在的分片，不同分片上的注册互不阻塞
+// 表项把哈希值、用户名和密码放在一次分配的内存中，没有红黑树节点和两个std::string的开销
+// 读者可能仍在访问重建前的槽数组和被删除的表项，先挂在分片的退役链表上，再用两阶段的读者计数（类似SRCU）回收：
+// 读者进入时在当前纪元对应的计数上加一，写者把退役对象摘下后两次翻转纪元，每次等旧纪元的读者计数归零，之后就没有读者能再看到它们；
+// 读者只在自己线程固定的分条上计数，不同线程的登录校验不争用同一个缓存行；读者很短，写者等待的时间也很短
+class user_table {
+public:
+    user_table() : m_epoch(0) {
+        for (int i = 0; i < UT_READER_STRIPES; ++i) {
+            m_readers[i].active[0] = 0;
+            m_readers[i].active[1] = 0;
+        }
+        for (int i = 0; i < UT_SHARDS; ++i) {
+            m_shards[i].tab.store(new_table(UT_INIT_SLOTS), memory_order_relaxed);
+            m_shards[i].used = 0;
+            m_shards[i].count = 0;
+        }
+    }
+    ~user_table() {
+        for (int i = 0; i < UT_SHARDS; ++i) {
+            shard &s = m_shards[i];
+            table *t = s.tab.load(memory_order_relaxed);
+            for (size_t j = 0; j <= t->mask; ++j) {
+                entry *e = t->slots[j].load(memory_order_relaxed);
+                if (e && e != tombstone()) free(e);
+            }
+            free_table(t);
+            free_retired(s.retired_tabs, s.retired_entries);
+        }
+    }
+
+    // 插入用户，用户名已存在时返回false，注册时据此同时完成查重和占位
+    bool insert(const char *name, const char *password) {
+        uint64_t hash = hash_of(name);
+        shard &s = shard_of(hash);
+        s.lock.lock();
+        table *t = s.tab.load(memory_order_relaxed);
+        size_t tomb = t->mask + 1;
+        size_t i = hash & t->mask;
+        for (;; i = (i + 1) & t->mask) {
+            entry *e = t->slots[i].load(memory_order_relaxed);
+            if (!e) break;
+            // 记下第一个墓碑，用户名不存在时复用它
+            if (e == tombstone()) {
+                if (tomb > t->mask) tomb = i;
+                continue;
+            }
+            if (e->hash == hash && !strcmp(e->data, name)) {
+                s.lock.unlock();
+                return false;
+            }
+        }
+        entry *e = new_entry(hash, name, password);
+        if (tomb <= t->mask) {
+            t->slots[tomb].store(e, memory_order_release);
+        } else {
+            t->slots[i].store(e, memory_order_release);
+            ++s.used;
+        }
+        ++s.count;
+        // 算上墓碑超过3/4时重建，同时清除墓碑
+        if (s.used * 4 >= (t->mask + 1) * 3) rehash(s);
+        bool full = need_reclaim(s);
+        s.lock.unlock();
+        if (full) reclaim(s);
+        return true;
+    }
+
+    // 删除用户，槽中换成墓碑，读者遇到墓碑时继续向后探测
+    bool erase(const char *name) {
+        uint64_t hash = hash_of(name);
+        shard &s = shard_of(hash);
+        s.lock.lock();
+        table *t = s.tab.load(memory_order_relaxed);
+        for (size_t i = hash & t->mask; ; i = (i + 1) & t->mask) {
+            entry *e = t->slots[i].load(memory_order_relaxed);
+            if (!e) break;
+            if (e != tombstone() && e->hash == hash && !strcmp(e->data, name)) {
+                t->slots[i].store(tombstone(), memory_order_release);
+                --s.count;
+                s.retired_entries.push_back(e);
+                bool full = need_reclaim(s);
+                s.lock.unlock();
+                if (full) reclaim(s);
+                return true;
+            }
+        }
+        s.lock.unlock();
+        return false;
+    }
+
+    // 登录校验，用户存在且密码一致时返回true，不加锁
+    bool check(const char *name, const char *password) const {
+        uint64_t hash = hash_of(name);
+        const shard &s = m_shards[hash >> (64 - UT_SHARD_BITS)];
+        reader_stripe &r = m_readers[stripe()];
+        unsigned idx = read_lock(r);
+        const table *t = s.tab.load(memory_order_acquire);
+        bool ok = false;
+        for (size_t i = hash & t->mask; ; i = (i + 1) & t->mask) {
+            const entry *e = t->slots[i].load(memory_order_acquire);
+            if (!e) break;
+            if (e != tombstone() && e->hash == hash && !strcmp(e->data, name)) {
+                ok = !strcmp(e->data + strlen(e->data) + 1, password);
+                break;
+            }
+        }
+        read_unlock(r, idx);
+        return ok;
+    }
+
+private:
+    // 表项，data中依次存放以'\0'结尾的用户名和密码
+    struct entry {
+        uint64_t hash;
+        char data[1];
+    };
+
+    struct table {
+        size_t mask;
+        atomic<entry*> *slots;
+    };
+
+    // 每个分片独占缓存行，避免不同分片上的注册互相影响
+    struct alignas(UT_CACHELINE) shard {
+        atomic<table*> tab;
+        size_t used;                        // 已占用的槽数，包括墓碑
+        size_t count;                       // 用户数
+        locker lock;                        // 只有写者加锁
+        vector<table*> retired_tabs;
+        vector<entry*> retired_entries;
+    };
+
+    // 两个纪元各自的读者数，独占缓存行
+    struct alignas(UT_CACHELINE) reader_stripe {
+        atomic<long> active[2];
+    };
+
+    static entry* tombstone() {return (entry *)1;}
+
+    // 线程第一次读时分到一条读者计数，之后固定使用
+    static int stripe() {
+        static atomic<unsigned> next(0);
+        static thread_local int id = next++ % UT_READER_STRIPES;
+        return id;
+    }
+
+    // 在当前纪元上登记读者，之后读到的槽数组和表项在read_unlock之前不会被释放
+    // 写者先发布新的槽数组再检查计数，读者先计数再读槽数组，二者都有全屏障，至少一方能看到对方
+    unsigned read_lock(reader_stripe &r) const {
+        unsigned idx = m_epoch.load(memory_order_relaxed) & 1;
+        r.active[idx].fetch_add(1, memory_order_seq_cst);
+        return idx;
+    }
+    static void read_unlock(reader_stripe &r, unsigned idx) {
+        r.active[idx].fetch_sub(1, memory_order_release);
+    }
+
+    // 等待调用前已经开始的读者全部离开：翻转两次纪元，每次等旧纪元的计数归零
+    // 只翻转一次时，读到旧纪元号但在翻转后才计数的读者会留在下一轮要等的计数之外
+    void synchronize() {
+        m_gp_lock.lock();
+        atomic_thread_fence(memory_order_seq_cst);
+        for (int round = 0; round < 2; ++round) {
+            unsigned old = m_epoch.load(memory_order_relaxed);
+            m_epoch.store(old + 1, memory_order_seq_cst);
+            for (int i = 0; i < UT_READER_STRIPES; ++i) {
+                while (m_readers[i].active[old & 1].load(memory_order_acquire)) sched_yield();
+            }
+        }
+        m_gp_lock.unlock();
+    }
+
+    // 持有分片锁时调用，有退役的槽数组或退役的表项攒够一批时需要回收
+    static bool need_reclaim(const shard &s) {
+        return !s.retired_tabs.empty() || s.retired_entries.size() >= UT_RECLAIM_BATCH;
+    }
+
+    // 摘下分片的退役链表，等现有的读者离开后释放；等待时不持有分片锁，不阻塞该分片上的注册
+    void reclaim(shard &s) {
+        vector<table*> tabs;
+        vector<entry*> entries;
+        s.lock.lock();
+        tabs.swap(s.retired_tabs);
+        entries.swap(s.retired_entries);
+        s.lock.unlock();
+        if (tabs.empty() && entries.empty()) return;
+        synchronize();
+        free_retired(tabs, entries);
+    }
+
+    static void free_retired(vector<table*> &tabs, vector<entry*> &entries) {
+        for (size_t j = 0; j < tabs.size(); ++j) free_table(tabs[j]);
+        for (size_t j = 0; j < entries.size(); ++j) free(entries[j]);
+        tabs.clear();
+        entries.clear();
+    }
+
+    // FNV-1a，高位用于选择分片，低位用于选择槽
+    static uint64_t hash_of(const char *name) {
+        uint64_t hash = 14695981039346656037ULL;
+        for (const unsigned char *p = (const unsigned char *)name; *p; ++p) {
+            hash ^= *p;
+            hash *= 1099511628211ULL;
+        }
+        return hash ^ (hash >> 32);
+    }
+
+    shard& shard_of(uint64_t hash) {return m_shards[hash >> (64 - UT_SHARD_BITS)];}
+
+    static entry* new_entry(uint64_t hash, const char *name, const char *password) {
+        size_t name_len = strlen(name) + 1, password_len = strlen(password) + 1;
+        entry *e = (entry *)malloc(offsetof(entry, data) + name_len + password_len);
+        e->hash = hash;
+        memcpy(e->data, name, name_len);
+        memcpy(e->data + name_len, password, password_len);
+        return e;
+    }
+
+    static table* new_table(size_t size) {
+        table *t = new table;
+        t->mask = size - 1;
+        t->slots = new atomic<entry*>[size]();
+        return t;
+    }
+
+    static void free_table(table *t) {
+        delete[] t->slots;
+        delete t;
+    }
+
+    // 重建槽数组，用户数超过一半时扩容为2倍，否则只是清除墓碑；新数组填好后才发布，旧数组退役，由调用者在解锁后回收
+    void rehash(shard &s) {
+        table *old = s.tab.load(memory_order_relaxed);
+        size_t size = old->mask + 1;
+        while (s.count * 2 >= size) size <<= 1;
+        table *t = new_table(size);
+        for (size_t i = 0; i <= old->mask; ++i) {
+            entry *e = old->slots[i].load(memory_order_relaxed);
+            if (!e || e == tombstone()) continue;
+            size_t j = e->hash & t->mask;
+            while (t->slots[j].load(memory_order_relaxed)) j = (j + 1) & t->mask;
+            t->slots[j].store(e, memory_order_relaxed);
+        }
+        s.used = s.count;
+        s.tab.store(t, memory_order_release);
+        s.retired_tabs.push_back(old);
+    }
+
+private:
+    shard m_shards[UT_SHARDS];
+    mutable reader_stripe m_readers[UT_READER_STRIPES];
+    atomic<unsigned> m_epoch;           // 读者登记在m_epoch & 1对应的计数上
+    locker m_gp_lock;                   // 同一时刻只有一个写者翻转纪元
+};
+
+#endif
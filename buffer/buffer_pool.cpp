@@ -0,0 +1,118 @@
+#include <stdlib.h>
+#include "buffer_pool.h"
+#include "../log/log.h"
+
+buffer_pool::buffer_pool() : m_max_size(BUFFER_MAX_SIZE), m_refills(0), m_drains(0), m_mallocs(0), m_malloc_bytes(0) {
+    for (int i = 0; i < BUFFER_CLASSES; ++i) {
+        m_free[i] = NULL;
+        m_count[i] = 0;
+    }
+}
+
+buffer_pool::~buffer_pool() {
+    for (int i = 0; i < BUFFER_CLASSES; ++i) {
+        while (m_free[i]) {
+            char *next = *(char **)m_free[i];
+            ::free(m_free[i]);
+            m_free[i] = next;
+        }
+    }
+}
+
+// 局部静态变量单例模式
+buffer_pool* buffer_pool::GetInstance() {
+    static buffer_pool bufferPool;
+    return &bufferPool;
+}
+
+void buffer_pool::init(int max_size) {
+    if (max_size > (BUFFER_MIN_SIZE << (BUFFER_CLASSES - 1))) max_size = BUFFER_MIN_SIZE << (BUFFER_CLASSES - 1);
+    m_max_size = max_size;
+}
+
+buffer_pool::thread_cache::thread_cache() {
+    for (int i = 0; i < BUFFER_CLASSES; ++i) {
+        free[i] = NULL;
+        count[i] = 0;
+    }
+}
+
+buffer_pool::thread_cache::~thread_cache() {
+    // 弹性线程池缩容时线程会退出，缓存的缓冲区留给其他线程
+    for (int i = 0; i < BUFFER_CLASSES; ++i) {
+        if (count[i]) GetInstance()->drain(*this, i, count[i]);
+    }
+}
+
+buffer_pool::thread_cache& buffer_pool::local() {
+    static thread_local thread_cache tc;
+    return tc;
+}
+
+int buffer_pool::size_class(int size) {
+    int cls = 0;
+    while ((BUFFER_MIN_SIZE << cls) < size) ++cls;
+    return cls;
+}
+
+char* buffer_pool::alloc(int &size) {
+    if (size > m_max_size) return NULL;
+    int cls = size_class(size);
+    size = BUFFER_MIN_SIZE << cls;
+    thread_cache &tc = local();
+    if (!tc.free[cls]) refill(tc, cls);
+    char *buf = tc.free[cls];
+    if (buf) {
+        tc.free[cls] = *(char **)buf;
+        --tc.count[cls];
+        return buf;
+    }
+    ++m_mallocs;
+    m_malloc_bytes += size;
+    return (char *)malloc(size);
+}
+
+void buffer_pool::release(char *buf, int size) {
+    int cls = size_class(size);
+    thread_cache &tc = local();
+    *(char **)buf = tc.free[cls];
+    tc.free[cls] = buf;
+    if (++tc.count[cls] > BUFFER_THREAD_CACHE) drain(tc, cls, BUFFER_THREAD_CACHE / 2);
+}
+
+void buffer_pool::refill(thread_cache &tc, int cls) {
+    m_lock.lock();
+    for (int i = 0; i < BUFFER_THREAD_CACHE / 2 && m_free[cls]; ++i) {
+        char *buf = m_free[cls];
+        m_free[cls] = *(char **)buf;
+        --m_count[cls];
+        *(char **)buf = tc.free[cls];
+        tc.free[cls] = buf;
+        ++tc.count[cls];
+    }
+    m_lock.unlock();
+    if (tc.free[cls]) ++m_refills;
+}
+
+void buffer_pool::drain(thread_cache &tc, int cls, int n) {
+    m_lock.lock();
+    for (int i = 0; i < n; ++i) {
+        char *buf = tc.free[cls];
+        tc.free[cls] = *(char **)buf;
+        --tc.count[cls];
+        *(char **)buf = m_free[cls];
+        m_free[cls] = buf;
+        ++m_count[cls];
+    }
+    m_lock.unlock();
+    ++m_drains;
+}
+
+void buffer_pool::log_stats() {
+    m_lock.lock();
+    int idle = 0;
+    for (int i = 0; i < BUFFER_CLASSES; ++i) idle += m_count[i];
+    m_lock.unlock();
+    LOG_INFO("buffer pool: %ld buffers allocated from the system (%ld bytes), %ld refills from and %ld drains to the global free list, %d idle in the global free list",
+             m_mallocs.load(), m_malloc_bytes.load(), m_refills.load(), m_drains.load(), idle);
+}
@@ -0,0 +1,62 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <atomic>
+#include "../lock/locker.h"
+using namespace std;
+
+#define BUFFER_MIN_SIZE 1024                // 最小的缓冲区，1KB
+#define BUFFER_MAX_SIZE (64 << 10)          // 缓冲区大小的默认上限，64KB，请求头部或响应头部超过上限时按原来的方式出错
+#define BUFFER_CLASSES 8                    // 大小分级数，1KB、2KB ... 128KB，上限不能超过最大的一级
+#define BUFFER_THREAD_CACHE 32              // 每个线程每级最多缓存的空闲缓冲区数，超过时一半还给全局空闲链表
+
+// 连接读写缓冲区的内存池，单例模式
+// 缓冲区按2的幂分级，每个线程为每级缓存一些空闲的缓冲区，分配和释放通常不加锁
+// 写缓冲区在工作线程中分配、在事件循环线程中释放，线程缓存满了或者空了时与全局空闲链表成批交换，一次加锁搬运一半
+class buffer_pool {
+public:
+    static buffer_pool* GetInstance();
+    // 设置缓冲区大小的上限，不调用时使用默认值
+    void init(int max_size);
+    int max_size() const {return m_max_size;}
+
+    // 分配不小于size的缓冲区，实际大小写入size；超过上限时返回NULL
+    char* alloc(int &size);
+    // 归还alloc得到的缓冲区，size为alloc写入的大小
+    void release(char *buf, int size);
+
+    // 统计信息写入日志：与全局空闲链表交换的次数和向系统申请的内存
+    void log_stats();
+
+private:
+    buffer_pool();
+    ~buffer_pool();
+
+    // 一个线程的空闲缓冲区，线程退出时全部还给全局空闲链表
+    struct thread_cache {
+        char *free[BUFFER_CLASSES];         // 空闲缓冲区的开头存放下一个空闲缓冲区的地址
+        int count[BUFFER_CLASSES];
+        thread_cache();
+        ~thread_cache();
+    };
+    static thread_cache& local();
+    static int size_class(int size);
+    // 从全局空闲链表取出最多BUFFER_THREAD_CACHE / 2个放入线程缓存
+    void refill(thread_cache &tc, int cls);
+    // 线程缓存中的n个缓冲区还给全局空闲链表
+    void drain(thread_cache &tc, int cls, int n);
+
+private:
+    int m_max_size;
+    locker m_lock;
+    char *m_free[BUFFER_CLASSES];           // 全局空闲链表
+    int m_count[BUFFER_CLASSES];
+
+    // 只在慢路径上计数，线程缓存命中时不访问共享的计数器
+    atomic<long> m_refills;                 // 线程缓存空了，从全局空闲链表取的次数
+    atomic<long> m_drains;                  // 线程缓存满了，还给全局空闲链表的次数
+    atomic<long> m_mallocs;                 // 线程缓存和全局空闲链表都没有，向系统申请的次数
+    atomic<long> m_malloc_bytes;
+};
+
+#endif
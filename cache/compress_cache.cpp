@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "compress_cache.h"
+#include "../log/log.h"
+
+compress_cache::compress_cache() : m_capacity(COMPRESS_CACHE_CAPACITY), m_size(0),
+                                   m_hits(0), m_misses(0), m_waits(0), m_saved(0) {}
+
+compress_cache::~compress_cache() {
+    for (list<compressed_file*>::iterator it = m_lru.begin(); it != m_lru.end(); ++it) {
+        free((*it)->data);
+        delete *it;
+    }
+}
+
+// 局部静态变量单例模式
+compress_cache* compress_cache::GetInstance() {
+    static compress_cache compressCache;
+    return &compressCache;
+}
+
+void compress_cache::init(size_t capacity) {
+    m_capacity = capacity;
+}
+
+compressed_file* compress_cache::acquire(const char *path, const struct stat &st, const char *data, const char *encoding) {
+    // 修改时间和大小放进键中，原文件被修改后不会命中旧的压缩结果
+    char stamp[64];
+    snprintf(stamp, sizeof(stamp), "\n%lx-%lx\n", (unsigned long)st.st_mtime, (unsigned long)st.st_size);
+    string key = path;
+    key += stamp;
+    key += encoding;
+
+    m_lock.lock();
+    compressed_file *file;
+    unordered_map<string, compressed_file*>::iterator it = m_files.find(key);
+    if (it != m_files.end()) {
+        file = it->second;
+        ++file->refs;
+        // 其他线程正在压缩同一文件，等它完成
+        if (file->loading) {
+            ++m_waits;
+            while (file->loading) m_compressed.wait(m_lock.get());
+        } else {
+            m_lru.splice(m_lru.begin(), m_lru, file->lru);
+        }
+        ++m_hits;
+    } else {
+        // 未命中，先放入一个压缩中的占位项，再在锁外压缩；占位项压缩完成后才进入LRU链表，不会被淘汰
+        ++m_misses;
+        file = new compressed_file;
+        file->key = key;
+        file->data = NULL;
+        file->st = st;
+        file->refs = 2;
+        file->loading = true;
+        m_files[key] = file;
+        m_lock.unlock();
+
+        compress(file, data, encoding);
+
+        m_lock.lock();
+        file->loading = false;
+        m_compressed.broadcast();
+        m_lru.push_front(file);
+        file->lru = m_lru.begin();
+        m_size += charge(file);
+        // 超过容量时从尾部淘汰，不淘汰刚放入的项
+        while (m_size > m_capacity && m_lru.back() != file) remove(m_lru.back());
+    }
+    if (!file->data) {
+        unref(file);
+        m_lock.unlock();
+        return NULL;
+    }
+    m_saved += st.st_size - file->st.st_size;
+    m_lock.unlock();
+    return file;
+}
+
+void compress_cache::release(compressed_file *file) {
+    m_lock.lock();
+    unref(file);
+    m_lock.unlock();
+}
+
+void compress_cache::compress(compressed_file *file, const char *data, const char *encoding) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    // windowBits加16输出gzip格式，否则输出HTTP的deflate编码要求的zlib格式
+    int window_bits = strcmp(encoding, "gzip") == 0 ? 15 + 16 : 15;
+    if (deflateInit2(&zs, COMPRESS_LEVEL, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) return;
+    // 输出缓冲区按压缩结果的上限分配，一次deflate即可完成
+    uLong bound = deflateBound(&zs, file->st.st_size);
+    char *out = (char *)malloc(bound);
+    zs.next_in = (Bytef *)data;
+    zs.avail_in = file->st.st_size;
+    zs.next_out = (Bytef *)out;
+    zs.avail_out = bound;
+    int ret = deflate(&zs, Z_FINISH);
+    deflateEnd(&zs);
+    // 没有变小的文件不值得压缩
+    if (ret != Z_STREAM_END || (off_t)zs.total_out >= file->st.st_size) {
+        free(out);
+        return;
+    }
+    file->data = (char *)realloc(out, zs.total_out);
+    file->st.st_size = zs.total_out;
+}
+
+void compress_cache::unref(compressed_file *file) {
+    if (--file->refs) return;
+    free(file->data);
+    delete file;
+}
+
+void compress_cache::remove(compressed_file *file) {
+    m_files.erase(file->key);
+    m_lru.erase(file->lru);
+    m_size -= charge(file);
+    unref(file);
+}
+
+void compress_cache::log_stats() {
+    m_lock.lock();
+    long total = m_hits + m_misses;
+    LOG_INFO("compress cache: %ld requests, hit ratio %.1f%%, %ld compressions, %ld waited for a concurrent compression, %zu entries %zu bytes, %lld bytes saved",
+             total, total ? m_hits * 100.0 / total : 0, m_misses, m_waits, m_files.size(), m_size, m_saved);
+    m_lock.unlock();
+}
@@ -0,0 +1,69 @@
+#ifndef COMPRESS_CACHE_H
+#define COMPRESS_CACHE_H
+
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <sys/stat.h>
+#include "../lock/locker.h"
+using namespace std;
+
+#define COMPRESS_CACHE_CAPACITY (16 << 20)  // 压缩结果总大小上限，16MB
+#define COMPRESS_MIN_SIZE 256               // 小于256字节的文件不压缩，压缩省下的字节抵不上响应头部的Content-Encoding和Vary
+#define COMPRESS_LEVEL 6                    // zlib压缩级别，与gzip命令默认相同
+
+// 一个文件按某种编码压缩后的内容，压缩完成后不再修改，可以在锁外读取
+struct compressed_file {
+    string key;                 // 路径、修改时间、大小和编码
+    char *data;                 // 压缩后的内容，压缩失败或没有变小时为NULL
+    struct stat st;             // 原文件的信息，st_size为压缩后的大小，ETag随之与原文件不同
+    int refs;                   // 引用计数，缓存本身持有一次，每个正在发送的连接各持有一次
+    bool loading;               // 正在压缩，同一文件的其他请求等待压缩完成，不重复压缩
+    list<compressed_file*>::iterator lru;
+};
+
+// 动态压缩结果缓存，单例模式
+// 没有预压缩文件的文本文件在工作线程中用zlib压缩，结果按(路径, 修改时间, 大小, 编码)缓存，热门页面只压缩一次
+// 原文件被修改后键随之改变，旧的结果不再命中，按LRU淘汰；压缩后没有变小的文件也缓存这一结论，不再反复尝试
+class compress_cache {
+public:
+    static compress_cache* GetInstance();
+    // 设置容量上限，不调用时使用默认值
+    void init(size_t capacity);
+
+    // 获取内容为data、信息为st的文件path按encoding（gzip或deflate）压缩后的结果，引用计数加1，发送完后调用release
+    // 压缩失败或没有变小时返回NULL，由调用者发送原文件
+    compressed_file* acquire(const char *path, const struct stat &st, const char *data, const char *encoding);
+    void release(compressed_file *file);
+
+    // 统计信息写入日志：命中率、压缩次数和节省的字节数
+    void log_stats();
+
+private:
+    compress_cache();
+    ~compress_cache();
+
+    // 在锁外压缩，失败或没有变小时data为NULL
+    static void compress(compressed_file *file, const char *data, const char *encoding);
+    // 引用计数减1，减到0时释放，需持有m_lock
+    void unref(compressed_file *file);
+    // 从缓存中移除已压缩完的项，需持有m_lock
+    void remove(compressed_file *file);
+    // 缓存项占用的大小，压缩失败的项只计键的长度
+    static size_t charge(compressed_file *file) {return file->key.size() + (file->data ? file->st.st_size : 0);}
+
+private:
+    locker m_lock;
+    cond m_compressed;                      // 压缩完成时广播
+    unordered_map<string, compressed_file*> m_files;
+    list<compressed_file*> m_lru;           // 头部为最近使用的项
+    size_t m_capacity;
+    size_t m_size;
+
+    long m_hits;
+    long m_misses;
+    long m_waits;                           // 等待其他线程压缩同一文件的次数
+    long long m_saved;                      // 命中时节省的字节数
+};
+
+#endif
@@ -0,0 +1,196 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include "file_cache.h"
+#include "../log/log.h"
+
+file_cache::file_cache() : m_capacity(FILE_CACHE_CAPACITY), m_max_file(FILE_CACHE_MAX_FILE), m_size(0),
+                           m_hits(0), m_misses(0), m_waits(0), m_bypass(0), m_negative(0) {}
+
+file_cache::~file_cache() {
+    for (list<cached_file*>::iterator it = m_lru.begin(); it != m_lru.end(); ++it) {
+        free((*it)->data);
+        delete *it;
+    }
+}
+
+// 局部静态变量单例模式
+file_cache* file_cache::GetInstance() {
+    static file_cache fileCache;
+    return &fileCache;
+}
+
+void file_cache::init(size_t capacity, size_t max_file) {
+    m_capacity = capacity;
+    m_max_file = max_file;
+}
+
+cached_file* file_cache::acquire(const char *path) {
+    time_t now = time(NULL);
+    file_key key = key_of(path);
+    m_lock.lock();
+    unordered_map<file_key, cached_file*, file_key_hash>::iterator it;
+    while ((it = m_files.find(key)) != m_files.end()) {
+        cached_file *file = it->second;
+        // 其他线程正在加载同一文件，等它完成，不重复读盘
+        if (file->loading) {
+            ++m_waits;
+            ++file->refs;
+            while (file->loading) m_loaded.wait(m_lock.get());
+            if (!file->ok) {
+                ++m_bypass;
+                unref(file);
+                m_lock.unlock();
+                return NULL;
+            }
+            ++m_hits;
+            m_lock.unlock();
+            return file;
+        }
+
+        // 超过校验间隔时stat一次，文件被修改或删除时移除旧的缓存项，按未命中处理；加载失败的项超过校验间隔后重新加载
+        // 其他线程正在校验时直接使用现有内容，与原来校验间隔内的命中一样
+        bool fresh = now - file->checked < FILE_CACHE_CHECK_SEC || file->revalidating;
+        if (fresh) {
+            m_lru.splice(m_lru.begin(), m_lru, file->lru);
+            if (!file->ok) {
+                ++m_negative;
+                m_lock.unlock();
+                return NULL;
+            }
+            ++m_hits;
+            ++file->refs;
+            m_lock.unlock();
+            return file;
+        }
+        if (!file->ok) {
+            remove(file);
+            break;
+        }
+
+        // stat在锁外进行，期间持有一次引用，缓存项被淘汰或被其他线程移除时也不会被释放
+        file->revalidating = true;
+        ++file->refs;
+        m_lock.unlock();
+        struct stat st;
+        bool same = stat(path, &st) == 0 && st.st_mtime == file->st.st_mtime && st.st_size == file->st.st_size;
+        m_lock.lock();
+        file->revalidating = false;
+        if (same) {
+            file->checked = now;
+            // 校验期间被淘汰的文件不在LRU链表中，仍可以发送，由这次的引用负责释放
+            if (cached(file)) m_lru.splice(m_lru.begin(), m_lru, file->lru);
+            ++m_hits;
+            m_lock.unlock();
+            return file;
+        }
+        // 文件已被修改或删除，旧的缓存项还在缓存中时移除，再重新查找：其他线程可能已经放入了新的加载中占位项
+        if (cached(file)) remove(file);
+        unref(file);
+    }
+
+    // 未命中，先放入一个加载中的占位项，再在锁外读盘；占位项加载完成后才进入LRU链表，不会被淘汰
+    ++m_misses;
+    cached_file *file = new cached_file;
+    file->path.assign(path, key.len);
+    file->hash = key.hash;
+    file->data = NULL;
+    file->refs = 2;
+    file->loading = true;
+    file->ok = false;
+    file->revalidating = false;
+    file->checked = now;
+    m_files[key_of(file)] = file;
+    m_lock.unlock();
+
+    bool ok = load(file);
+
+    m_lock.lock();
+    file->loading = false;
+    file->ok = ok;
+    m_loaded.broadcast();
+    m_lru.push_front(file);
+    file->lru = m_lru.begin();
+    m_size += charge(file);
+    // 超过容量时从尾部淘汰，不淘汰刚放入的文件
+    while (m_size > m_capacity && m_lru.back() != file) remove(m_lru.back());
+    if (!ok) {
+        // 不可缓存的文件只记下失败，由调用者按原流程返回404/403等
+        --m_misses;
+        ++m_bypass;
+        free(file->data);
+        file->data = NULL;
+        unref(file);
+        m_lock.unlock();
+        return NULL;
+    }
+    m_lock.unlock();
+    return file;
+}
+
+void file_cache::release(cached_file *file) {
+    m_lock.lock();
+    unref(file);
+    m_lock.unlock();
+}
+
+bool file_cache::load(cached_file *file) {
+    int fd = open(file->path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    // 与do_request的检查相同，只缓存其他用户可读的普通文件
+    if (fstat(fd, &file->st) < 0 || !S_ISREG(file->st.st_mode) || (file->st.st_mode & S_IROTH) == 0 ||
+        (size_t)file->st.st_size > m_max_file) {
+        close(fd);
+        return false;
+    }
+    size_t size = file->st.st_size;
+    file->data = (char *)malloc(size ? size : 1);
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = read(fd, file->data + done, size - done);
+        if (n <= 0) break;
+        done += n;
+    }
+    close(fd);
+    // 读取过程中文件被截断，不缓存
+    return done == size;
+}
+
+void file_cache::unref(cached_file *file) {
+    if (--file->refs) return;
+    free(file->data);
+    delete file;
+}
+
+file_key file_cache::key_of(const char *path) {
+    size_t hash = 14695981039346656037ULL;
+    const unsigned char *p = (const unsigned char *)path;
+    for (; *p; ++p) {
+        hash ^= *p;
+        hash *= 1099511628211ULL;
+    }
+    return {path, (size_t)((const char *)p - path), hash ^ (hash >> 32)};
+}
+
+bool file_cache::cached(const cached_file *file) const {
+    unordered_map<file_key, cached_file*, file_key_hash>::const_iterator it = m_files.find(key_of(file));
+    return it != m_files.end() && it->second == file;
+}
+
+void file_cache::remove(cached_file *file) {
+    m_files.erase(key_of(file));
+    m_lru.erase(file->lru);
+    m_size -= charge(file);
+    unref(file);
+}
+
+void file_cache::log_stats() {
+    m_lock.lock();
+    long total = m_hits + m_misses + m_bypass + m_negative;
+    // 原流程每个请求stat/open/mmap/close/munmap共5次系统调用；命中为0次（超过校验间隔时1次stat），未命中为open/fstat/read/close共4次
+    // 命中加载失败的记录时省去一次失败的open
+    double saved = total ? (m_hits * 5.0 + m_misses * 1.0 + m_negative * 1.0) / total : 0;
+    LOG_INFO("file cache: %ld requests, hit ratio %.1f%%, %ld waited for a concurrent load, %ld bypassed, %ld negative hits, %zu files %zu bytes, %.2f syscalls saved per request",
+             total, total ? m_hits * 100.0 / total : 0, m_waits, m_bypass, m_negative, m_files.size(), m_size, saved);
+    m_lock.unlock();
+}
@@ -0,0 +1,97 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <list>
+#include <string>
+#include <string.h>
+#include <unordered_map>
+#include <time.h>
+#include <sys/stat.h>
+#include "../lock/locker.h"
+using namespace std;
+
+#define FILE_CACHE_CAPACITY (64 << 20)      // 缓存的文件内容总大小上限，64MB
+#define FILE_CACHE_MAX_FILE (4 << 20)       // 大于4MB的文件不缓存，仍然每次打开并mmap
+#define FILE_CACHE_CHECK_SEC 1              // 缓存项最多每秒stat一次，文件被修改后重新加载
+
+// 缓存的一个文件，内容和文件信息在加载完成后不再修改，可以在锁外读取
+struct cached_file {
+    string path;
+    size_t hash;                // path的哈希值，插入和移除时不再重新计算
+    char *data;                 // 文件内容
+    struct stat st;             // 文件信息，do_request用它填写m_file_stat
+    int refs;                   // 引用计数，缓存本身持有一次，每个正在发送该文件的连接各持有一次
+    bool loading;               // 正在从磁盘加载，同一文件的其他请求等待加载完成，不重复读盘
+    bool ok;                    // 加载成功，失败的项也留在缓存中，校验间隔内不再尝试
+    bool revalidating;          // 有线程正在锁外stat校验，其他线程直接使用现有内容，不重复stat
+    time_t checked;             // 上次stat校验的时间
+    list<cached_file*>::iterator lru;
+};
+
+// m_files的键，指向缓存项自己的path或者查找时调用者传入的路径，查找时不必为路径构造string
+struct file_key {
+    const char *path;
+    size_t len;
+    size_t hash;
+    bool operator==(const file_key &other) const {
+        return hash == other.hash && len == other.len && memcmp(path, other.path, len) == 0;
+    }
+};
+
+struct file_key_hash {
+    size_t operator()(const file_key &key) const {return key.hash;}
+};
+
+// 静态文件缓存，单例模式
+// 按完整路径缓存文件内容和stat信息，命中时不再有stat/open/mmap/close/munmap五次系统调用
+// 总大小超过上限时按LRU淘汰，被淘汰的文件如果还有连接在发送，等最后一个连接release后才释放内存
+// 不存在或不可缓存的文件也记录下来，校验间隔内直接返回NULL，查找不存在的预压缩文件时不再反复open
+class file_cache {
+public:
+    static file_cache* GetInstance();
+    // 设置容量上限和可缓存的最大文件，不调用时使用默认值
+    void init(size_t capacity, size_t max_file);
+
+    // 获取path的缓存，引用计数加1，发送完后调用release
+    // 文件不存在、不可读、不是普通文件或者太大时返回NULL，由调用者按原来的stat/mmap流程处理
+    cached_file* acquire(const char *path);
+    void release(cached_file *file);
+
+    // 统计信息写入日志：命中率、等待同一文件加载的次数、命中加载失败记录的次数、平均每个请求节省的系统调用数
+    void log_stats();
+
+private:
+    file_cache();
+    ~file_cache();
+
+    // 在锁外从磁盘读取文件内容，失败时返回false
+    bool load(cached_file *file);
+    // 引用计数减1，减到0时释放，需持有m_lock
+    void unref(cached_file *file);
+    // 从缓存中移除已加载的文件，需持有m_lock
+    void remove(cached_file *file);
+    // 按FNV-1a计算路径的哈希值，同时得到长度
+    static file_key key_of(const char *path);
+    static file_key key_of(const cached_file *file) {return {file->path.c_str(), file->path.size(), file->hash};}
+    // file是否仍是path在缓存中的项，锁外校验期间它可能已被淘汰或移除，需持有m_lock
+    bool cached(const cached_file *file) const;
+    // 缓存项占用的大小，加载失败的项只计路径的长度
+    static size_t charge(cached_file *file) {return file->ok ? file->st.st_size : file->path.size();}
+
+private:
+    locker m_lock;
+    cond m_loaded;                          // 文件加载完成时广播
+    unordered_map<file_key, cached_file*, file_key_hash> m_files;
+    list<cached_file*> m_lru;               // 头部为最近使用的文件
+    size_t m_capacity;
+    size_t m_max_file;
+    size_t m_size;                          // 缓存中的文件内容总大小
+
+    long m_hits;
+    long m_misses;
+    long m_waits;                           // 等待其他线程加载同一文件的次数
+    long m_bypass;                          // 不可缓存的请求数
+    long m_negative;                        // 命中加载失败的记录、没有再次尝试加载的次数
+};
+
+#endif
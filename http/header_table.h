@@ -0,0 +1,77 @@
+#ifndef HEADER_TABLE_H
+#define HEADER_TABLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <string_view>
+#include "http_scan.h"
+using namespace std;
+
+// 一个请求的全部头部字段，parse_header每解析一行add一次，整个头部只扫描一遍
+// 字段名和值都指向读缓冲区，不复制也不分配内存，容量固定；读缓冲区中的请求被覆盖前有效
+// 常见字段（header_id）按id直接索引，O(1)查询，不认识的字段只能遍历
+class header_table {
+public:
+    // 一个请求最多记录的字段数，浏览器通常发送10~20个
+    static const int MAX_HEADERS = 48;
+
+    header_table() {clear();}
+
+    // 开始解析新的请求前清空
+    void clear() {
+        m_count = 0;
+        memset(m_index, -1, sizeof(m_index));
+    }
+
+    // 记录一个字段，value须在name之后，表满或字段名、值的长度及二者的距离超过UINT16_MAX时返回false
+    // 读缓冲区上限可以到128KB，这样的行只可能是恶意请求，直接拒绝而不是截断
+    // 同名字段出现多次时都会记录，get返回第一个
+    bool add(header_id id, const char *name, int name_len, const char *value, int value_len) {
+        if (m_count == MAX_HEADERS) return false;
+        if (name_len > UINT16_MAX || value - name > UINT16_MAX || value_len > UINT16_MAX) return false;
+        field &f = m_fields[m_count];
+        f.name = name;
+        f.id = id;
+        f.name_len = name_len;
+        f.value_off = value - name;
+        f.value_len = value_len;
+        if (id != HDR_UNKNOWN && m_index[id] < 0) m_index[id] = m_count;
+        ++m_count;
+        return true;
+    }
+
+    bool has(header_id id) const {return m_index[id] >= 0;}
+    // 字段id的值，没有该字段时返回data()为NULL的空值
+    string_view get(header_id id) const {
+        return m_index[id] < 0 ? string_view() : m_fields[m_index[id]].value();
+    }
+
+    // 读缓冲区搬到新的位置后，所有字段整体偏移delta
+    void rebase(ptrdiff_t delta) {
+        for (int i = 0; i < m_count; ++i) m_fields[i].name += delta;
+    }
+
+    // 按出现顺序遍历全部字段
+    int size() const {return m_count;}
+    header_id id(int i) const {return (header_id)m_fields[i].id;}
+    string_view name(int i) const {return string_view(m_fields[i].name, m_fields[i].name_len);}
+    string_view value(int i) const {return m_fields[i].value();}
+
+private:
+    // 值用相对字段名的偏移表示，一个字段16字节
+    struct field {
+        const char *name;
+        int16_t id;
+        uint16_t name_len;
+        uint16_t value_off;
+        uint16_t value_len;
+        string_view value() const {return string_view(name + value_off, value_len);}
+    };
+    field m_fields[MAX_HEADERS];
+    int m_count;
+    // 常见字段第一次出现的位置，没有时为-1
+    signed char m_index[HDR_COUNT];
+};
+
+#endif
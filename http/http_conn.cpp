@@ -1,8 +1,16 @@
 #include "http_conn.h"
 #include "../log/log.h"
+#include "../CGI_MySQL/user_table.h"
+#include "http_scan.h"
 #include <map>
 #include <mysql/mysql.h>
 #include <fstream>
+#include <ctype.h>
+#include <time.h>
+#include <fnmatch.h>
+#include <sys/sendfile.h>
+#include <netinet/tcp.h>
+#include <errno.h>
 
 // 定义两种文件描述符的触发方式，如果是ET边缘触发的话，下次调用后不返回，每次必须读取完所有的数据，故fd应设置为非阻塞
 #define listenfdLT      // 监听fd水平触发（阻塞）
@@ -11,29 +19,168 @@
 // #define connfdLT     // 连接fd水平触发（阻塞）
 #define connfdET        // 连接fd边缘触发（非阻塞）
 
+// 不在文件缓存中的文件（大文件）用sendfile从文件直接发送到socket，不再mmap到进程地址空间，注释掉则仍用mmap + writev
+// io_uring后端没有sendfile操作，总是使用mmap
+#define SENDFILE
+
+// 没有预压缩文件的文本文件在工作线程中动态压缩，结果缓存在compress_cache中，注释掉则只发送预压缩文件
+#define COMPRESS
+
 // 定义http响应的一些常见的状态信息
 const char *ok_200_title = "OK";
+const char *ok_206_title = "Partial Content";
+const char *not_modified_304_title = "Not Modified";
 const char *error_400_title = "Bad Request";
 const char *error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
 const char *error_403_title = "Forbidden";
 const char *error_403_form = "You do not have permission to get file from this server.\n";
 const char *error_404_title = "Not Found";
 const char *error_404_form = "The requested file was not found on this server.\n";
+const char *error_416_title = "Range Not Satisfiable";
+const char *error_416_form = "The requested range is not satisfiable.\n";
+// 多区间响应multipart/byteranges的分段头部和结束分隔符
+const char *part_header_format = "%s--%s\r\nContent-Type: text/html\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n";
+const char *boundary_end_format = "\r\n--%s--\r\n";
 const char *error_500_title = "Internal Error";
 const char *error_500_form = "There was an unusual problem serving the requested file.\n";
+const char *error_501_title = "Not Implemented";
+const char *error_501_form = "The request uses a transfer coding that this server does not support.\n";
 
 // 网站的根目录
 const char *doc_root = "/home/zzr/TinyWebServer/root";
 
-// 初始化两个静态成员变量
-// 所有socket上的事件都被注册到同一个epoll内核事件表中，所以将epollfd设置为静态成员变量
-int http_conn::m_epollfd = -1;
-// 统计用户数量
-int http_conn::m_user_count = 0;
+// 按路径设置Cache-Control，路径为文件相对网站根目录的路径，用fnmatch通配符匹配，取第一条匹配的规则，都不匹配时不发送
+// 图片等静态资源让浏览器缓存一天，页面每次都要向服务器确认，没有修改时只需一次304响应
+struct cache_rule {
+    const char *pattern;
+    const char *value;
+};
+const cache_rule cache_rules[] = {
+    {"*.jpg", "public, max-age=86400"},
+    {"*.png", "public, max-age=86400"},
+    {"*.gif", "public, max-age=86400"},
+    {"*.ico", "public, max-age=604800"},
+    {"*.mp4", "public, max-age=86400"},
+    {"*.html", "no-cache"},
+};
+
+// 可压缩的文本文件，这些文件的响应带Vary: Accept-Encoding，并在浏览器接受时查找预压缩文件
+// 预压缩文件由make precompress生成，与原文件同名加上.br或.gz后缀
+const char *compressible_files[] = {"*.html", "*.css", "*.js", "*.json", "*.svg", "*.txt", "*.xml"};
+// 按优先级排列的预压缩编码
+struct precompressed {
+    const char *encoding;
+    const char *suffix;
+};
+const precompressed precompressed_files[] = {
+    {"br", ".br"},
+    {"gzip", ".gz"},
+};
+// 按优先级排列的动态压缩编码，zlib支持这两种
+const char *dynamic_encodings[] = {"gzip", "deflate"};
+
+// 初始化静态成员变量，统计用户数量
+std::atomic<int> http_conn::m_user_count(0);
+connection_pool *http_conn::m_conn_pool = NULL;
+
+// 将表中的用户名和密码放入分片哈希表，登录校验不加锁，注册只锁用户名所在的分片
+user_table users;
+
+// 异步注册请求的上下文，查询完成前连接可能已被关闭并复用，因此单独保存连接代数和用户名
+struct register_ctx {
+    http_conn *conn;
+    conn_owner *owner;
+    unsigned gen;
+    string name;
+};
+
+// 同步注册使用的预处理语句，按连接池中的连接缓存，每条连接只在第一次注册时prepare一次
+// 连接被取出期间只有一个线程使用，故只需在查找缓存时加锁
+map<MYSQL*, MYSQL_STMT*> register_stmts;
+locker register_stmts_lock;
+
+// 用预处理语句插入一个用户，用户名和密码作为参数传给服务端，不会被注入，成功返回0
+static int insert_user(MYSQL *mysql, const char *name, const char *password) {
+    register_stmts_lock.lock();
+    MYSQL_STMT *&stmt = register_stmts[mysql];
+    register_stmts_lock.unlock();
+    if (!stmt) {
+        const char *sql = "INSERT INTO user(username, password) VALUES (?, ?)";
+        stmt = mysql_stmt_init(mysql);
+        if (!stmt) return -1;
+        if (mysql_stmt_prepare(stmt, sql, strlen(sql))) {
+            LOG_ERROR("prepare error:%s", mysql_stmt_error(stmt));
+            mysql_stmt_close(stmt);
+            stmt = NULL;
+            return -1;
+        }
+    }
 
-// 将表中的用户名和密码放入map，再定义一个互斥锁
-map<string, string> users;
-locker m_lock;
+    MYSQL_BIND bind[2];
+    memset(bind, 0, sizeof(bind));
+    unsigned long name_len = strlen(name), password_len = strlen(password);
+    bind[0].buffer_type = MYSQL_TYPE_STRING;
+    bind[0].buffer = (void *)name;
+    bind[0].buffer_length = name_len;
+    bind[0].length = &name_len;
+    bind[1].buffer_type = MYSQL_TYPE_STRING;
+    bind[1].buffer = (void *)password;
+    bind[1].buffer_length = password_len;
+    bind[1].length = &password_len;
+    if (mysql_stmt_bind_param(stmt, bind) || mysql_stmt_execute(stmt)) {
+        LOG_ERROR("INSERT error:%s", mysql_stmt_error(stmt));
+        return -1;
+    }
+    return 0;
+}
+
+// ETag由文件的修改时间和大小生成，与nginx相同，文件被修改后ETag随之改变
+static void format_etag(char *buf, int size, const struct stat &st) {
+    snprintf(buf, size, "\"%lx-%lx\"", (unsigned long)st.st_mtime, (unsigned long)st.st_size);
+}
+
+// HTTP日期格式，例：Sun, 06 Nov 1994 08:49:37 GMT
+static void format_http_date(char *buf, int size, time_t t) {
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(buf, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+// 解析HTTP日期，格式不对时返回-1
+static time_t parse_http_date(const char *text) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char *end = strptime(text, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (!end || *end != '\0') return -1;
+    return timegm(&tm);
+}
+
+// 文件是否可压缩，path为相对网站根目录的路径
+static bool compressible(const char *path) {
+    for (size_t i = 0; i < sizeof(compressible_files) / sizeof(compressible_files[0]); ++i) {
+        if (fnmatch(compressible_files[i], path, 0) == 0) return true;
+    }
+    return false;
+}
+
+// Accept-Encoding中是否接受编码coding，例：gzip, deflate, br;q=0.8，q=0表示不接受
+static bool accepts_encoding(const char *header, const char *coding) {
+    int len = strlen(coding);
+    const char *p = header;
+    while (*p) {
+        p += strspn(p, " \t,");
+        int n = strcspn(p, " \t;,");
+        if ((n == len && strncasecmp(p, coding, len) == 0) || (n == 1 && *p == '*')) {
+            p += n;
+            p += strspn(p, " \t");
+            if (*p != ';') return true;
+            const char *q = strchr(p, '=');
+            return !q || strtod(q + 1, NULL) > 0;
+        }
+        p += strcspn(p, ",");
+    }
+    return false;
+}
 
 // 定义几个处理文件描述符的函数，在main函数中会用到，并借助extern关键字声明
 // 1.定义文件描述符非阻塞
@@ -110,38 +257,203 @@ void modfd(int epollfd, int fd, int ev) {
 
 // 接下来就是所有成员函数的定义部分了，下面尽量按照头文件中声明的顺序来定义
 // 初始化一个新的http对象，内部会调用私有成员函数init()
-void http_conn::init(int sockfd, const sockaddr_in &addr) {
+void http_conn::init(int sockfd, const sockaddr_in &addr, int epollfd, conn_owner *owner, io_notifier *notifier) {
+    m_epollfd = epollfd;
+    m_notifier = notifier;
     m_sockfd = sockfd;
-    m_address = addr;
+    if (!m_cold) {
+        m_cold = new conn_cold;
+        m_cold->gen = 0;
+    }
+    m_cold->address = addr;
+    m_cold->owner = owner;
+    ++m_cold->gen;
+    // 流水线请求的响应可能分几次发送，关闭Nagle算法，否则后一次的小块数据要等对端的延迟确认（约40ms）才会发出
+    int nodelay = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
     // 改动1
-    addfd(m_epollfd, sockfd, true);
+    if (!m_notifier) addfd(m_epollfd, sockfd, true);
     ++m_user_count;
+    // 上一个使用该fd的连接可能在发送途中被关闭，先释放它持有的文件和缓冲区
+    unmap();
+    free_read_buf();
+    free_write_buf();
     init();
 }
 // 私有成员函数init()
 void http_conn::init() {
-    m_mysql = NULL;
+    m_cold->mysql = NULL;
     m_read_idx = 0;
+    m_keep_alive = false;
+    free_read_buf();
+    init_request();
+    init_response();
+}
+
+void http_conn::init_request() {
     m_checked_idx = 0;
     m_start_line = 0;
-    m_write_idx = 0;
     m_check_state = CHECK_STATE_REQUESTLINE;
     m_method = GET;
     m_url = NULL;
     m_version = NULL;
-    m_host = NULL;
+    m_content_encoding = NULL;
     m_content_length = 0;
     m_linger = false;
-    m_cgi = 0;    
+    if (m_req) {
+        m_req->headers.clear();
+        memset(m_real_file, '\0', FILENAME_LEN);
+        m_req->cgi = 0;
+        m_req->finish_page = NULL;
+    }
+}
+
+void http_conn::init_response() {
+    m_write_idx = 0;
+    m_resp_start = 0;
     m_bytes_to_send = 0;
     m_bytes_have_sent = 0;
-    memset(m_read_buf, '\0', READ_BUFFER_SIZE);
-    memset(m_write_buf, '\0', WRITE_BUFFER_SIZE);
-    memset(m_real_file, '\0', FILENAME_LEN);
+    m_iv_idx = 0;
+    m_iv_base = 0;
+    m_iv_count = 0;
+    // 响应已发送完，写缓冲区和响应状态还给内存池，下一个响应生成时再分配
+    free_write_buf();
+    free_response();
+}
+
+void http_conn::end_request() {
+    m_keep_alive = m_linger;
+    // 请求到m_checked_idx为止（POST请求包括请求体），之后是客户端没等响应就发来的下一个请求
+    // 已生成的响应不再引用读缓冲区，可以把剩余的数据移到开头，腾出空间继续读取
+    int left = m_read_idx - m_checked_idx;
+    if (left > 0) {
+        memmove(m_read_buf, m_read_buf + m_checked_idx, left);
+        memset(m_read_buf + left, '\0', m_checked_idx);
+    } else {
+        // 没有后续请求时读缓冲区还给内存池，等待下一个请求的长连接不占用缓冲区
+        free_read_buf();
+    }
+    m_read_idx = left;
+    init_request();
+}
+
+bool http_conn::grow_read_buf() {
+    return resize_read_buf(m_read_buf ? m_read_size * 2 : READ_BUFFER_SIZE);
+}
+
+bool http_conn::resize_read_buf(int size) {
+    if (!m_req) {
+        // 开始接收一个请求，挂上解析状态
+        int req_size = sizeof(request_state);
+        char *req = buffer_pool::GetInstance()->alloc(req_size);
+        if (!req) return false;
+        m_req = new (req) request_state;
+        m_real_file = m_req->real_file;
+        memset(m_real_file, '\0', FILENAME_LEN);
+        m_req->finish_page = NULL;
+    }
+    char *buf = buffer_pool::GetInstance()->alloc(size);
+    if (!buf) return false;
+    // 从内存池取出的缓冲区内容是旧的，与原来一样保证已读数据之后都是'\0'
+    memset(buf + m_read_idx, '\0', size - m_read_idx);
+    if (m_read_buf) {
+        memcpy(buf, m_read_buf, m_read_idx);
+        // 解析到一半的请求已经记下了请求行和头部字段的位置，随数据一起搬移
+        ptrdiff_t delta = buf - m_read_buf;
+        if (m_url) m_url += delta;
+        if (m_version) m_version += delta;
+        m_req->headers.rebase(delta);
+        buffer_pool::GetInstance()->release(m_read_buf, m_read_size);
+    }
+    m_read_buf = buf;
+    m_read_size = size;
+    return true;
+}
+
+bool http_conn::grow_write_buf() {
+    int size = m_write_buf ? m_write_size * 2 : WRITE_BUFFER_SIZE;
+    char *buf = buffer_pool::GetInstance()->alloc(size);
+    if (!buf) return false;
+    if (m_write_buf) {
+        memcpy(buf, m_write_buf, m_write_idx);
+        // 排队的流水线响应和当前响应已写好的部分由m_iv指向，文件区间指向文件缓存或映射区，不在写缓冲区内
+        for (int i = 0; i < MAX_IOV; ++i) {
+            char *base = (char *)m_iv[i].iov_base;
+            if (base >= m_write_buf && base < m_write_buf + m_write_size) m_iv[i].iov_base = buf + (base - m_write_buf);
+        }
+        buffer_pool::GetInstance()->release(m_write_buf, m_write_size);
+    }
+    m_write_buf = buf;
+    m_write_size = size;
+    return true;
+}
+
+void http_conn::free_read_buf() {
+    if (!m_req) return;
+    if (m_read_buf) buffer_pool::GetInstance()->release(m_read_buf, m_read_size);
+    buffer_pool::GetInstance()->release((char *)m_req, sizeof(request_state));
+    m_read_buf = NULL;
+    m_read_size = 0;
+    m_req = NULL;
+    m_real_file = NULL;
+}
+
+bool http_conn::attach_response() {
+    if (m_resp) return true;
+    int size = sizeof(response_state);
+    char *resp = buffer_pool::GetInstance()->alloc(size);
+    if (!resp) return false;
+    m_resp = (response_state *)resp;
+    m_file_stat = &m_resp->file_stat;
+    m_ranges = m_resp->ranges;
+    m_queued = m_resp->queued;
+    m_iv = m_resp->iv;
+    // grow_write_buf按地址修正m_iv，从内存池取出的旧内容不能被误认为指向写缓冲区
+    memset(m_iv, 0, sizeof(m_resp->iv));
+    return true;
+}
+
+void http_conn::free_response() {
+    if (!m_resp) return;
+    buffer_pool::GetInstance()->release((char *)m_resp, sizeof(response_state));
+    m_resp = NULL;
+    m_file_stat = NULL;
+    m_ranges = NULL;
+    m_queued = NULL;
+    m_iv = NULL;
+}
+
+void http_conn::free_write_buf() {
+    if (!m_write_buf) return;
+    buffer_pool::GetInstance()->release(m_write_buf, m_write_size);
+    m_write_buf = NULL;
+    m_write_size = 0;
+}
+
+bool http_conn::queue_response() {
+    if (!m_keep_alive || m_read_idx == 0) return false;
+    // sendfile的文件和mmap的映射区每个连接只有一个，只能留给最后一个响应
+    if (m_file_fd >= 0 || (m_file_address && !m_cache_file && !m_compressed_file)) return false;
+    // 下一个响应的头部和iovec要放得下，否则先把已生成的响应发出去，剩下的请求发送完后再处理
+    if (m_queued_count == MAX_PIPELINE - 1 || m_iv_count + 2 > MAX_IOV ||
+        buffer_pool::GetInstance()->max_size() - m_write_idx < RESPONSE_RESERVE) return false;
+    m_queued[m_queued_count].cache = m_cache_file;
+    m_queued[m_queued_count++].compressed = m_compressed_file;
+    m_cache_file = NULL;
+    m_compressed_file = NULL;
+    m_file_address = NULL;
+    m_resp_start = m_write_idx;
+    m_iv_base = m_iv_count;
+    return true;
 }
 
 // 关闭当前http连接，从静态成员m_epollfd中删除当前socketfd连接，注意并不是真正移除，直接将sockfd置-1，并将用户数-1
 void http_conn::close_conn(bool real_close) {
+    // 非epoll后端由事件循环负责关闭，保证fd关闭前其上没有未完成的读写请求
+    if (real_close && m_notifier && m_sockfd != -1) {
+        m_notifier->notify(this, 0);
+        return;
+    }
     // 调用之前的removefd函数
     if (real_close && m_sockfd != -1) {
         removefd(m_epollfd, m_sockfd);
@@ -151,33 +463,131 @@ void http_conn::close_conn(bool real_close) {
 }
 
 // 由线程池中的工作线程调用，这是处理HTTP请求的入口函数
+// 读缓冲区中有多个流水线请求时依次处理，响应按顺序排在m_write_buf和m_iv中，最后一次writev发出
 void http_conn::process() {
-    HTTP_CODE read_res = process_read();
-    // 如果返回NO_REQUEST，说明请求不完整，需要继续读取数据
-    if (read_res == NO_REQUEST) {
-        // 向内核事件表中注册并监听读事件
-        printf("No request\n");
-        modfd(m_epollfd, m_sockfd, EPOLLIN);
+    if (!attach_response()) {
+        close_conn();
         return;
     }
-    // 若读取成功，根据返回的请求报文解析结果调用process_write完成响应报文填写
-    bool write_res = process_write(read_res);
-    if (!write_res) {
-        close_conn();
+    // 异步注册的插入语句已执行完，由事件循环交回，生成响应后与普通请求一样注册写事件
+    if (m_req && m_req->finish_page) {
+        const char *page = m_req->finish_page;
+        m_req->finish_page = NULL;
+        finish_request(page);
+        return;
+    }
+    while (true) {
+        HTTP_CODE read_res = process_read();
+        // 如果返回NO_REQUEST，说明请求不完整，需要继续读取数据
+        if (read_res == NO_REQUEST) {
+            // 向内核事件表中注册并监听读事件，前面已经生成了流水线响应时先发送它们，发送完后再读取
+            printf("No request\n");
+            rearm(m_iv_count ? EPOLLOUT : EPOLLIN);
+            return;
+        }
+        // 注册请求已交给数据库线程，查询完成后由register_done生成响应报文，这里不注册任何事件
+        if (read_res == PENDING_REQUEST) return;
+        // 若读取成功，根据返回的请求报文解析结果调用process_write完成响应报文填写
+        bool write_res = process_write(read_res);
+        if (!write_res) {
+            // 连接已关闭，不能再注册写事件
+            close_conn();
+            return;
+        }
+        end_request();
+        if (!queue_response()) break;
     }
     // 向内核事件表中注册并监听写事件
-    modfd(m_epollfd, m_sockfd, EPOLLOUT);
+    rearm(EPOLLOUT);
+}
+
+// 重新注册EPOLLONESHOT事件，非epoll后端则交给所属事件循环去提交对应的读写请求
+void http_conn::rearm(int ev) {
+    if (m_notifier) m_notifier->notify(this, ev);
+    else modfd(m_epollfd, m_sockfd, ev);
+}
+
+// io_uring后端从缓冲环中取到数据后调用，和read_once一样追加到m_read_buf末尾
+bool http_conn::read_buffer(const char *data, int len) {
+    if (len <= 0) return false;
+    if (m_read_idx + len > m_read_size) {
+        // 一次换成放得下的大小，不必逐次倍增
+        int size = m_read_buf ? m_read_size * 2 : READ_BUFFER_SIZE;
+        if (!resize_read_buf(size > m_read_idx + len ? size : m_read_idx + len)) return false;
+    }
+    memcpy(m_read_buf + m_read_idx, data, len);
+    m_read_idx += len;
+    return true;
+}
+
+// io_uring后端的writev完成后调用，全部发送完毕时与write函数的收尾逻辑相同
+bool http_conn::write_done(int bytes) {
+    update_iovec(bytes);
+    if (m_bytes_to_send > 0) return true;
+    unmap();
+    if (m_keep_alive) {
+        init_response();
+        return true;
+    }
+    // 短连接发送完后即将关闭，缓冲区不必留到fd被复用
+    free_read_buf();
+    init_response();
+    return false;
+}
+
+void http_conn::update_iovec(int bytes) {
+    m_bytes_have_sent += bytes;
+    m_bytes_to_send -= bytes;
+
+    // 跳过已经发完的内存块，再把第一个没发完的内存块的起点后移
+    // 文件区间的iov_len可能超过int的范围，按size_t比较
+    while (m_iv_idx < m_iv_count && (size_t)bytes >= m_iv[m_iv_idx].iov_len) {
+        bytes -= m_iv[m_iv_idx].iov_len;
+        m_iv[m_iv_idx++].iov_len = 0;
+    }
+    if (m_iv_idx < m_iv_count) {
+        // sendfile的文件区间没有映射区，只需减少剩余长度
+        if (m_iv[m_iv_idx].iov_base) m_iv[m_iv_idx].iov_base = (char *)m_iv[m_iv_idx].iov_base + bytes;
+        m_iv[m_iv_idx].iov_len -= bytes;
+    }
 }
 
 // 由主线程读取浏览器发来的数据，如果工作在ET模式下，需要一次性非阻塞地循环读取全部数据
-bool http_conn::read_once() {
-    // 如果已经读取数据长度大于总缓冲区长度，返回false
-    if (m_read_idx >= READ_BUFFER_SIZE) return false;
+bool http_conn::read_once(char *scratch, int scratch_size) {
+    // 没有挂上读缓冲区时先读入事件循环的临时缓冲区，读到数据后再按实际长度取得读缓冲区
+    // 只读到EOF或EAGAIN的读事件（比如空闲的长连接被对端关闭）不会分配任何内存
+    if (!m_read_buf) {
+        int len = 0;
+#ifdef connfdLT
+        len = recv(m_sockfd, scratch, scratch_size, 0);
+        return len > 0 && read_buffer(scratch, len);
+#endif
+
+#ifdef connfdET
+        while (len < scratch_size) {
+            int bytes_read = recv(m_sockfd, scratch + len, scratch_size - len, 0);
+            if (bytes_read == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                return false;
+            } else if (bytes_read == 0) {
+                return false;
+            }
+            len += bytes_read;
+        }
+        if (len == 0) return true;
+        if (!read_buffer(scratch, len)) return false;
+        // 临时缓冲区没有读满说明已经读完，否则接着读入刚挂上的读缓冲区
+        // 临时缓冲区与读缓冲区上限一样大，读满时挂上的缓冲区已经不能再增长，由下面的循环直接返回true，先处理已读到的请求
+        if (len < scratch_size) return true;
+#endif
+    }
 
     // 定义已经读取的字数遍变量
     int bytes_read = 0;
 #ifdef connfdLT
-    bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0);
+    // 缓冲区已满时先增长，已经到上限说明请求太大，返回false
+    if (m_read_idx == m_read_size && !grow_read_buf()) return false;
+    bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, m_read_size - m_read_idx, 0);
         if (bytes_read <= 0) {
             return false;
         } else {
@@ -188,8 +598,10 @@ bool http_conn::read_once() {
 
 #ifdef connfdET
     while (true) {
-        // 注意参数，从m_read_buf + m_read_idx开始读，能读取长度READ_BUFFER_SIZE - m_read_idx
-        bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0);
+        // 流水线请求可能把缓冲区填满，先增长；已到上限时先处理已读到的请求，处理完重新注册读事件时内核会再次报告剩余的数据
+        if (m_read_idx == m_read_size && !grow_read_buf()) break;
+        // 注意参数，从m_read_buf + m_read_idx开始读，能读取长度m_read_size - m_read_idx
+        bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, m_read_size - m_read_idx, 0);
         if (bytes_read == -1) {
             // 返回-1说明出错，但是如果对于非阻塞ET模式，EAGAIN/EWOULDBLOCK表示没有数据可以读取或者数据已经全部读取完毕
             // 此时break，epoll就能再次触发sockfd上的EPOLLIN事件，以驱动下一次读操作
@@ -223,7 +635,22 @@ bool http_conn::write() {
     // 一次性循环写入响应报文内容
     while (true) {
         // 将响应报文的状态行、消息头、空行和响应正文发送给浏览器端
-        tmp = writev(m_sockfd, m_iv, m_iv_count);
+        // 使用sendfile时，响应报文和分段头部用writev发送，文件区间用sendfile发送，发送位置由区间终点和剩余长度算出
+        // 被EAGAIN打断后update_iovec已记下剩余长度，下次从该处继续
+        if (m_file_fd >= 0 && m_iv_idx > m_iv_base && ((m_iv_idx - m_iv_base) & 1)) {
+            off_t offset = m_ranges[(m_iv_idx - m_iv_base) / 2].end - m_iv[m_iv_idx].iov_len;
+            tmp = sendfile(m_sockfd, m_file_fd, &offset, m_iv[m_iv_idx].iov_len);
+            // 文件在发送途中被截断，无法发完，按出错处理
+            if (tmp == 0) {
+                unmap();
+                return false;
+            }
+        } else if (m_file_fd >= 0) {
+            // 文件区间之前的排队响应和当前响应的头部一起writev
+            tmp = writev(m_sockfd, m_iv + m_iv_idx, m_iv_idx < m_iv_base ? m_iv_base + 1 - m_iv_idx : 1);
+        } else {
+            tmp = writev(m_sockfd, m_iv + m_iv_idx, m_iv_count - m_iv_idx);
+        }
         
         // 改动4 下面有部分改动
 
@@ -236,17 +663,7 @@ bool http_conn::write() {
             return false;
         }
 
-        m_bytes_have_sent += tmp;
-        m_bytes_to_send -= tmp;
-
-        if (m_bytes_have_sent >= m_iv[0].iov_len) {
-            m_iv[0].iov_len = 0;
-            m_iv[1].iov_base = m_file_address + (m_bytes_have_sent - m_write_idx);
-            m_iv[1].iov_len = m_bytes_to_send;
-        } else {
-            m_iv[0].iov_base = m_write_buf + m_bytes_have_sent;
-            m_iv[0].iov_len = m_iv[0].iov_len - m_bytes_have_sent;
-        }
+        update_iovec(tmp);
 
         // if (tmp > 0) {
         //     // 更新已发送字节
@@ -284,15 +701,19 @@ bool http_conn::write() {
         // // 更新待发送的字节数
         // m_bytes_to_send -= tmp;
 
-        // 如果m_iv缓冲区全部发送完，取消映射，重新注册事件，并根据m_linger是否保持连接
+        // 如果m_iv缓冲区全部发送完，取消映射，重新注册事件，并根据m_keep_alive是否保持连接
         if (m_bytes_to_send <= 0) {
             unmap();
-            modfd(m_epollfd, m_sockfd, EPOLLIN);
-            if (m_linger) {
-                // 如果是长连接，再次初始化http对象，返回true，否则返回false
-                init();
+            if (m_keep_alive) {
+                // 如果是长连接，清空写缓冲区，返回true，否则返回false
+                // 读缓冲区中还有流水线请求时不注册读事件，由事件循环交给工作线程继续处理
+                init_response();
+                if (!has_buffered_request()) modfd(m_epollfd, m_sockfd, EPOLLIN);
                 return true;
             } else {
+                // 短连接发送完后即将关闭，缓冲区不必留到fd被复用
+                free_read_buf();
+                init_response();
                 return false;
             }
         }
@@ -301,6 +722,7 @@ bool http_conn::write() {
 
 // 同步线程池初始化数据库读取表
 void http_conn::initmysql_result(connection_pool *connPool) {
+    m_conn_pool = connPool;
     // 先从连接池中取出一个mysql连接
     MYSQL *mysql = NULL;
     connectionRAII mysqlconn(&mysql, connPool);
@@ -320,11 +742,9 @@ void http_conn::initmysql_result(connection_pool *connPool) {
     // 返回所有字段结构的数组，这句话好像也没啥用
     MYSQL_FIELD *fields = mysql_fetch_fields(result);
 
-    // 从已有的结果集中自动获取下一行，并将tiny_webserver.user表中存放的对应用户名和密码存入map(users)中
+    // 从已有的结果集中自动获取下一行，并将tiny_webserver.user表中存放的对应用户名和密码存入users中
     while (MYSQL_ROW row = mysql_fetch_row(result)) {
-        string tmp1(row[0]);
-        string tmp2(row[1]);
-        users[tmp1] = tmp2;
+        users.insert(row[0], row[1]);
     }
 }
 
@@ -358,7 +778,7 @@ http_conn::HTTP_CODE http_conn::process_read() {
         {
             // 解析请求行，顺利的话主状态机状态会变成CHECK_STATE_HEADER，跳出switch，再次进入while循环
             res = parse_request_line(text);
-            if (res == BAD_REQUEST) return BAD_REQUEST;
+            if (res == BAD_REQUEST) return bad_request();
             break;  // 返回NO_REQUEST的情况
         }
 
@@ -368,7 +788,7 @@ http_conn::HTTP_CODE http_conn::process_read() {
             // 如果是GET请求报文，直接响应，若POST还需要继续break进入while循环
             // 下次循环满足m_check_state == CHECK_STATE_CONTENT && line_status == LINE_OK条件，此时发生逻辑短路，从状态机不再读取新的一行
             res = parse_header(text);
-            if (res == BAD_REQUEST) return BAD_REQUEST;
+            if (res == BAD_REQUEST || res == NOT_IMPLEMENTED) return bad_request(res);
             // 如果收到完整请求报文（GET方法），进行跳转到报文响应函数
             else if (res == GET_REQUEST) return do_request();
             break;  // 返回NO_REQUEST的情况
@@ -399,28 +819,49 @@ bool http_conn::process_write(HTTP_CODE res) {
     {
     // 200 文件存在
     case FILE_REQUEST: {
-        add_status_line(200, ok_200_title);
-        if (m_file_stat.st_size == 0) {
+        if (m_method == GET && not_modified()) {
+            // 304 浏览器缓存的文件仍然有效，只返回头部，没有响应体
+            add_status_line(304, not_modified_304_title);
+            add_file_headers();
+            add_linger();
+            add_blank_line();
+            break;
+        }
+        if (m_file_stat->st_size == 0) {
             // 如果请求文件为空，返回空白的html文件
+            add_status_line(200, ok_200_title);
             const char *ok_string = "<html><body></body></html>";
             add_headers(strlen(ok_string));
             if (!add_content(ok_string)) return false;
-            return true;
-        } else {
-            // 请求文件非空时
-            add_headers(m_file_stat.st_size);
-            // m_iv[0]指向响应报文缓冲区
-            m_iv[0].iov_base = m_write_buf;
-            m_iv[0].iov_len = m_write_idx;
-            // m_iv[1]指向请求文件映射区，长度为文件大小
-            m_iv[1].iov_base = m_file_address;
-            m_iv[1].iov_len = m_file_stat.st_size;
-            m_iv_count = 2;
-            // 待发送数据长度等于写缓冲区字节数+文件大小
-            m_bytes_to_send = m_write_idx + m_file_stat.st_size;
-            return true;
+            break;
         }
-        break;
+        // GET请求带Range字段时只返回请求的区间
+        int n = m_req->headers.has(HDR_RANGE) && m_method == GET && range_valid() ? parse_range() : 0;
+        if (n < 0) {
+            // 416 所有区间都超出文件末尾，告知文件大小
+            add_status_line(416, error_416_title);
+            add_response("Content-Range: bytes */%lld\r\n", (long long)m_file_stat->st_size);
+            add_headers(strlen(error_416_form));
+            if (!add_content(error_416_form)) return false;
+            break;
+        }
+        if (n > 0 && add_ranges(n)) return true;
+        // 没有Range字段，或者分段头部写不下时返回整个文件
+        m_write_idx = m_resp_start;
+        add_status_line(200, ok_200_title);
+        add_response("Accept-Ranges: bytes\r\n");
+        add_file_headers();
+        add_headers(m_file_stat->st_size);
+        // m_iv[m_iv_base]指向响应报文缓冲区，m_iv[m_iv_base + 1]指向整个文件
+        m_iv[m_iv_base].iov_base = m_write_buf + m_resp_start;
+        m_iv[m_iv_base].iov_len = m_write_idx - m_resp_start;
+        m_ranges[0].begin = 0;
+        m_ranges[0].end = m_file_stat->st_size;
+        file_iovec(0);
+        m_iv_count = m_iv_base + 2;
+        // 待发送数据长度加上响应报文长度+文件大小，前面可能还有排队的流水线响应
+        m_bytes_to_send += m_write_idx - m_resp_start + m_file_stat->st_size;
+        return true;
     }
     // 403 资源无权限访问，不可读
     case FORBIDDEN_REQUEST: {
@@ -437,6 +878,13 @@ bool http_conn::process_write(HTTP_CODE res) {
         if (!add_content(error_404_form)) return false;
         break;
     }
+    // 501 不支持的Transfer-Encoding，请求体的边界无法确定，响应后关闭连接
+    case NOT_IMPLEMENTED: {
+        add_status_line(501, error_501_title);
+        add_headers(strlen(error_501_form));
+        if (!add_content(error_501_form)) return false;
+        break;
+    }
     // 500 内部错误
     case INTERNAL_ERROR: {
         add_status_line(500, error_500_title);
@@ -451,15 +899,173 @@ bool http_conn::process_write(HTTP_CODE res) {
 
     // 能运行到这里的只有403 404 500，或者200 且请求文件为空，这些状态只能申请一个iovec，指向响应报文缓冲区
     // 结构体iovec中的iov_base指向数据的地址
-    m_iv[0].iov_base = m_write_buf;
+    m_iv[m_iv_base].iov_base = m_write_buf + m_resp_start;
     // 结构体iovec中的iov_len表示数据的长度
-    m_iv[0].iov_len = m_write_idx;
-    m_iv_count = 1;
+    m_iv[m_iv_base].iov_len = m_write_idx - m_resp_start;
+    m_iv_count = m_iv_base + 1;
     // 改动6
-    m_bytes_to_send = m_write_idx;
+    m_bytes_to_send += m_write_idx - m_resp_start;
+    return true;
+}
+
+int http_conn::parse_range() {
+    off_t size = m_file_stat->st_size;
+    const char *p = header(HDR_RANGE);
+    // 只支持字节区间，其他单位忽略
+    if (strncasecmp(p, "bytes=", 6) != 0) return 0;
+    p += 6;
+    int n = 0;
+    while (true) {
+        p += strspn(p, " \t");
+        char *q;
+        long long begin, end;
+        if (*p == '-' && isdigit(p[1])) {
+            // bytes=-500，最后500个字节，-0不可满足
+            long long len = strtoll(p + 1, &q, 10);
+            begin = len < size ? size - len : 0;
+            end = len ? size : 0;
+        } else if (isdigit(*p)) {
+            // bytes=500-999或bytes=500-，终点超出文件时截到文件末尾
+            begin = strtoll(p, &q, 10);
+            if (*q++ != '-') return 0;
+            end = size;
+            if (isdigit(*q)) {
+                long long last = strtoll(q, &q, 10);
+                if (last < begin) return 0;
+                if (last < size) end = last + 1;
+            }
+        } else {
+            return 0;
+        }
+        // 起点超出文件的区间不可满足，跳过
+        if (begin < end) {
+            if (n == MAX_RANGES) return 0;
+            m_ranges[n].begin = begin;
+            m_ranges[n++].end = end;
+        }
+        p = q + strspn(q, " \t");
+        if (*p == '\0') break;
+        if (*p++ != ',') return 0;
+    }
+    if (n == 0) return -1;
+
+    // 区间很少，插入排序后合并重叠或相邻的区间，避免同一段内容重复发送
+    for (int i = 1; i < n; ++i) {
+        file_range r = m_ranges[i];
+        int j = i;
+        for (; j > 0 && m_ranges[j - 1].begin > r.begin; --j) m_ranges[j] = m_ranges[j - 1];
+        m_ranges[j] = r;
+    }
+    int merged = 0;
+    for (int i = 1; i < n; ++i) {
+        if (m_ranges[i].begin <= m_ranges[merged].end) {
+            if (m_ranges[i].end > m_ranges[merged].end) m_ranges[merged].end = m_ranges[i].end;
+        } else {
+            m_ranges[++merged] = m_ranges[i];
+        }
+    }
+    return merged + 1;
+}
+
+bool http_conn::add_ranges(int n) {
+    off_t size = m_file_stat->st_size;
+    if (n == 1) {
+        // 单个区间，Content-Range说明区间位置，正文就是该区间的内容
+        off_t len = m_ranges[0].end - m_ranges[0].begin;
+        if (!add_status_line(206, ok_206_title) || !add_response("Accept-Ranges: bytes\r\n") ||
+            !add_response("Content-Range: bytes %lld-%lld/%lld\r\n", (long long)m_ranges[0].begin,
+                          (long long)m_ranges[0].end - 1, (long long)size) || !add_file_headers())
+            return false;
+        add_headers(len);
+        m_iv[m_iv_base].iov_base = m_write_buf + m_resp_start;
+        m_iv[m_iv_base].iov_len = m_write_idx - m_resp_start;
+        file_iovec(0);
+        m_iv_count = m_iv_base + 2;
+        m_bytes_to_send += m_write_idx - m_resp_start + len;
+        return true;
+    }
+
+    // 多个区间，每个区间前面是分隔符和分段头部，最后是结束分隔符，分隔符用递增的序号，与nginx相同
+    static std::atomic<unsigned long> boundary_seq(0);
+    char boundary[24];
+    snprintf(boundary, sizeof(boundary), "%020lu", ++boundary_seq);
+    // 先算出正文长度写入Content-Length，再依次写入分段头部
+    long long content_length = snprintf(NULL, 0, boundary_end_format, boundary);
+    for (int i = 0; i < n; ++i)
+        content_length += snprintf(NULL, 0, part_header_format, i ? "\r\n" : "", boundary, (long long)m_ranges[i].begin,
+                                   (long long)m_ranges[i].end - 1, (long long)size) + m_ranges[i].end - m_ranges[i].begin;
+    if (!add_status_line(206, ok_206_title) || !add_response("Accept-Ranges: bytes\r\n") || !add_file_headers() ||
+        !add_content_length(content_length) || !add_linger() ||
+        !add_response("Content-Type: multipart/byteranges; boundary=%s\r\n", boundary) || !add_blank_line())
+        return false;
+
+    // 前面排队的流水线响应占用的iovec较多时放不下全部区间，返回整个文件
+    if (m_iv_base + 2 * n + 1 > MAX_IOV) return false;
+    // m_iv[m_iv_base]为响应报文头部和第一个分段头部，m_iv[m_iv_base + 2 * i]为第i个区间之前的分段头部，m_iv[m_iv_base + 2 * n]为结束分隔符
+    int start = m_resp_start;
+    for (int i = 0; i <= n; ++i) {
+        if (i < n) {
+            if (!add_response(part_header_format, i ? "\r\n" : "", boundary, (long long)m_ranges[i].begin,
+                              (long long)m_ranges[i].end - 1, (long long)size))
+                return false;
+            file_iovec(i);
+        } else if (!add_response(boundary_end_format, boundary)) {
+            return false;
+        }
+        m_iv[m_iv_base + 2 * i].iov_base = m_write_buf + start;
+        m_iv[m_iv_base + 2 * i].iov_len = m_write_idx - start;
+        start = m_write_idx;
+    }
+    m_iv_count = m_iv_base + 2 * n + 1;
+    m_bytes_to_send += m_write_idx - m_resp_start;
+    for (int i = 0; i < n; ++i) m_bytes_to_send += m_ranges[i].end - m_ranges[i].begin;
     return true;
 }
 
+void http_conn::file_iovec(int i) {
+    m_iv[m_iv_base + 2 * i + 1].iov_base = m_file_address ? m_file_address + m_ranges[i].begin : NULL;
+    m_iv[m_iv_base + 2 * i + 1].iov_len = m_ranges[i].end - m_ranges[i].begin;
+}
+
+bool http_conn::not_modified() {
+    // 两者都有时以If-None-Match为准
+    const char *if_none_match = header(HDR_IF_NONE_MATCH);
+    if (if_none_match) {
+        char etag[40];
+        format_etag(etag, sizeof(etag), *m_file_stat);
+        int len = strlen(etag);
+        // 逗号分隔的ETag列表，按弱比较忽略W/前缀，*匹配任何存在的文件
+        const char *p = if_none_match;
+        while (*p) {
+            p += strspn(p, " \t,");
+            if (*p == '*') return true;
+            if (strncmp(p, "W/", 2) == 0) p += 2;
+            if (strncmp(p, etag, len) == 0 && (p[len] == '\0' || p[len] == ',' || p[len] == ' ' || p[len] == '\t'))
+                return true;
+            p += strcspn(p, ",");
+        }
+        return false;
+    }
+    const char *if_modified_since = header(HDR_IF_MODIFIED_SINCE);
+    if (if_modified_since) {
+        time_t since = parse_http_date(if_modified_since);
+        return since != -1 && m_file_stat->st_mtime <= since;
+    }
+    return false;
+}
+
+bool http_conn::range_valid() {
+    const char *if_range = header(HDR_IF_RANGE);
+    if (!if_range) return true;
+    // If-Range可以是ETag或日期，都要求与当前文件完全一致，弱ETag不能用于Range
+    if (if_range[0] == '"') {
+        char etag[40];
+        format_etag(etag, sizeof(etag), *m_file_stat);
+        return strcmp(if_range, etag) == 0;
+    }
+    return parse_http_date(if_range) == m_file_stat->st_mtime;
+}
+
 // 主状态机解析报文的请求行数据，获得请求方法，目标url及http版本号，例：
 // GET /562f25980001b1b106000338.jpg HTTP/1.1
 http_conn::HTTP_CODE http_conn::parse_request_line(char *text) {
@@ -477,7 +1083,7 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char *text) {
     // 改动2
     else if (strcasecmp(method, "POST") == 0) {
         m_method = POST;
-        m_cgi = 1;
+        m_req->cgi = 1;
     }
     else return BAD_REQUEST;
 
@@ -512,7 +1118,7 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char *text) {
     return NO_REQUEST;
 }
 
-// 主状态机解析报文的请求头部数据，仅尝试分析几个关键字段，其他字段记录在日志中
+// 主状态机解析报文的请求头部数据，全部字段记入m_headers，Content-Length和Connection在这里处理，不认识的字段记录在日志中
 http_conn::HTTP_CODE http_conn::parse_header(char *text) {
     // 若当前行为空行，判断接下来是否有请求体，若有说明是POST请求，否则GET请求直接返回进行do_request处理即可
     if (text[0] == '\0') {
@@ -526,32 +1132,52 @@ http_conn::HTTP_CODE http_conn::parse_header(char *text) {
         }
     }
 
-    else if (strncasecmp(text, "Host:", 5) == 0) {
-        // 处理host字段  Host:www.wrox.com
-        text += 5;
-        text += strspn(text, " \t");
-        m_host = text;
+    // 向量化地找到字段名后的冒号，一行以parse_line写入的'\0'结束，最远扫描到m_checked_idx，再用完美哈希识别字段名
+    char *line_end = m_read_buf + m_checked_idx - 2;
+    char *colon = (char *)scan_any(text, line_end, ':', '\0');
+    if (*colon != ':') {
+        LOG_INFO("oop!unknow header: %s", text);
+        Log::get_instance()->flush();
+        return NO_REQUEST;
     }
-
-    else if (strncasecmp(text, "Content-Length:", 15) == 0) {
+    header_id id = lookup_header(text, colon - text);
+    // 去掉值前后的空白，在值的末尾写'\0'，之后可以直接当作C字符串使用
+    char *value = colon + 1;
+    value += strspn(value, " \t");
+    while (line_end > value && (line_end[-1] == ' ' || line_end[-1] == '\t')) --line_end;
+    *line_end = '\0';
+    // 所有字段都记入m_headers，不复制，Range、If-None-Match等字段在生成响应时按id查询
+    // 重复的Content-Length无论值是否相同都拒绝，否则前后两个解析器可能各取一个，对请求体长度产生分歧
+    if (id == HDR_CONTENT_LENGTH && m_req->headers.has(id)) return BAD_REQUEST;
+    if (!m_req->headers.add(id, text, colon - text, value, line_end - value)) return BAD_REQUEST;
+
+    switch (id)
+    {
+    case HDR_CONTENT_LENGTH:
+    {
         // 处理Content-Length字段  Content-Length:40
-        text += 15;
-        text += strspn(text, " \t");
-        m_content_length = stoi(text);
-    }
-
-    else if (strncasecmp(text, "Connection:", 11) == 0) {
-        // 处理Connection字段  Connection:Keep-Alive
-        text += 11;
-        text += strspn(text, " \t");
-        // 如果是长连接，将m_linger设置为true
-        if (strcasecmp(text, "keep-alive") == 0) m_linger = true;
+        // 流水线请求按它移动m_checked_idx，负数、非数字和超过缓冲区上限的值都按错误请求处理
+        char *end;
+        errno = 0;
+        long len = strtol(value, &end, 10);
+        if (end == value || *end != '\0' || errno != 0 || len < 0 || len > buffer_pool::GetInstance()->max_size()) return BAD_REQUEST;
+        m_content_length = len;
+        break;
     }
-
-    else {
+    case HDR_TRANSFER_ENCODING:
+        // 不支持分块等传输编码，忽略它会把请求体当成下一个流水线请求解析（请求走私），直接以501拒绝并关闭连接
+        return NOT_IMPLEMENTED;
+    case HDR_CONNECTION:
+        // 处理Connection字段  Connection:Keep-Alive，如果是长连接，将m_linger设置为true
+        if (strcasecmp(value, "keep-alive") == 0) m_linger = true;
+        break;
+    case HDR_UNKNOWN:
         // printf("Oops! That's a unknow header: %s\n", text);
         LOG_INFO("oop!unknow header: %s", text);
         Log::get_instance()->flush();
+        break;
+    default:
+        break;
     }
 
     return NO_REQUEST;
@@ -559,11 +1185,11 @@ http_conn::HTTP_CODE http_conn::parse_header(char *text) {
 
 // 主状态机解析报文的请求体数据，仅适用于POST请求
 http_conn::HTTP_CODE http_conn::parse_content(char *text) {
-    if (m_content_length + m_checked_idx <= m_read_idx) {
-        // 将请求体的最后一位置为\0，此时text中存储用户的账号和密码信息，放入m_user_data成员变量中
-        text[m_content_length] = '\0';
-        m_user_data = text;
-        printf("m_user_data: %s\n", m_user_data);
+    if (m_read_idx - m_checked_idx >= m_content_length) {
+        // 此时text中存储用户的账号和密码信息，放入m_user_data成员变量中
+        // 请求体之后可能紧跟着下一个流水线请求，不再在末尾写'\0'，按m_content_length截取，m_checked_idx移到请求体之后
+        m_req->user_data = text;
+        m_checked_idx += m_content_length;
         // 交到do_request函数中
         return GET_REQUEST;
     }
@@ -582,7 +1208,7 @@ http_conn::HTTP_CODE http_conn::do_request() {
     const char *p = strrchr(m_url, '/');
 
     // 2 3分别为登录和注册校验页面，单独讨论
-    if (m_cgi == 1 && (*(p + 1) == '2' || *(p + 1) == '3')) {
+    if (m_req->cgi == 1 && (*(p + 1) == '2' || *(p + 1) == '3')) {
         // 定义一个字符串，用来表示m_real_file后的尾缀
         // 改动7 源代码里面下面这几句话纯属坑人，real_url变量一点用都没有，还给m_real_file后面加了个CGISQL.cgi
         // char *real_url = (char *)malloc(sizeof(char) * 200);
@@ -593,54 +1219,69 @@ http_conn::HTTP_CODE http_conn::do_request() {
 
         // 将用户名和密码提取出来
         // 格式：  user=123&password=456
+        // 请求体最长可到读缓冲区的上限，超过数组长度的字段按错误请求处理，不能按请求体长度直接复制
         char name[100], password[100];
         int i = 5;  // 越过 user=长度
-        for (; m_user_data[i] != '&'; ++i) {
-            name[i - 5] = m_user_data[i];
+        for (; i < m_content_length && m_req->user_data[i] != '&'; ++i) {
+            if (i - 5 >= (int)sizeof(name) - 1) return BAD_REQUEST;
+            name[i - 5] = m_req->user_data[i];
         }
         name[i - 5] = '\0';
         i += 10;    // 越过 &password= 长度
         int j = 0;
-        for (; m_user_data[i] != '\0'; ++i, ++j) {
-            password[j] = m_user_data[i];
+        for (; i < m_content_length; ++i, ++j) {
+            if (j >= (int)sizeof(password) - 1) return BAD_REQUEST;
+            password[j] = m_req->user_data[i];
         }
         password[j] = '\0';
-        printf("user: %s, password: %s\n", name, password);
 
         // 同步线程登录校验
         if (*(p + 1) == '3') {
             // 如果是注册校验，先检查是否有重名，若没有，再进行注册
-            // 改动8，username写成user了，艹
-            char *sql_insert = (char *)malloc(sizeof(char) * 200);
-            // 改动9 这里第一个把strcat改成strcpy！
-            strcpy(sql_insert, "INSERT INTO user(username, password) VALUES (");
-            strcat(sql_insert, "'");        // 加个单引号增加搜索效率？
-            strcat(sql_insert, name);
-            strcat(sql_insert, "', '");
-            strcat(sql_insert, password);
-            strcat(sql_insert, "')");       // 注意这里最后不用加 ; 表示结束
-
-            if (users.find(name) == users.end()) {
-                // 用户不存在，加锁注册用户，保证同步
-                m_lock.lock();
-                // 说实话感觉下面这个判断有点鸡肋，执行insert语句，若失败返回非0值
-                // 改动9 woc这里没加斜杠 淦
-                int res = mysql_query(m_mysql, sql_insert);
-                users[name] = password;
-                m_lock.unlock();
-
-                // insert语句插入失败
-                if (res) strcpy(m_url, "/registerError.html");
-                // 插入成功
-                else strcpy(m_url, "/log.html");
-            } else {
+            // 用户名和密码不再拼接进SQL语句：异步注册由sql_async转义后合并成多行INSERT，同步注册使用预处理语句
+            // 先在users中占住用户名，查重和占位是一次原子操作，插入数据库失败时再删除
+            if (!users.insert(name, password)) {
                 // 用户已存在，注册失败
                 strcpy(m_url, "/registerError.html");
+            } else if (sql_async::GetInstance()->enabled()) {
+                // 异步注册，工作线程不用等待数据库的响应
+                register_ctx *ctx = new register_ctx;
+                ctx->conn = this;
+                ctx->owner = m_cold->owner;
+                ctx->gen = m_cold->gen;
+                ctx->name = name;
+                vector<string> values;
+                values.push_back(name);
+                values.push_back(password);
+                // 提交前标记等待，查询可能在submit_insert返回前就完成
+                ctx->owner->set_pending(this, true);
+                if (sql_async::GetInstance()->submit_insert("user(username, password)", values, register_done, ctx)) return PENDING_REQUEST;
+                ctx->owner->set_pending(this, false);
+                delete ctx;
+                users.erase(name);
+                strcpy(m_url, "/registerError.html");
+            } else {
+                int res;
+                {
+                    // 只有注册请求需要数据库连接，在这里按需取出，离开作用域时自动归还连接池
+                    connectionRAII mysqlcon(&m_cold->mysql, m_conn_pool);
+                    // 用户名已经占住，不同用户的注册可以同时执行insert语句，若失败返回非0值
+                    res = insert_user(m_cold->mysql, name, password);
+                }
+                m_cold->mysql = NULL;
+
+                // insert语句插入失败，释放占住的用户名
+                if (res) {
+                    users.erase(name);
+                    strcpy(m_url, "/registerError.html");
+                }
+                // 插入成功
+                else strcpy(m_url, "/log.html");
             }
 
         } else if (*(p + 1) == '2') {
-            // 如果是登录校验，直接在已有的users即map集合中进行查找，并返回对应的页面
-            if (users.find(name) != users.end() && users[name] == password) strcpy(m_url, "/welcome.html");
+            // 如果是登录校验，直接在users中查找，不加锁，并返回对应的页面
+            if (users.check(name, password)) strcpy(m_url, "/welcome.html");
             else strcpy(m_url, "/logError.html");
         }
         printf("%s\n", m_real_file);
@@ -664,26 +1305,123 @@ http_conn::HTTP_CODE http_conn::do_request() {
     else strcat(m_real_file, m_url);
 
     printf("%s\n", m_real_file);
+    return map_file();
+}
+
+// 获取m_real_file的文件信息和内容
+http_conn::HTTP_CODE http_conn::map_file() {
+    // 命中文件缓存时不再有stat/open/mmap/close，发送完后也不用munmap
+    m_cache_file = file_cache::GetInstance()->acquire(m_real_file);
+    if (m_cache_file) {
+        *m_file_stat = m_cache_file->st;
+        m_file_address = m_cache_file->data;
+        if (m_req->headers.has(HDR_ACCEPT_ENCODING) && m_method == GET) map_encoded();
+        return FILE_REQUEST;
+    }
+
+    // 文件不存在、不可读、是目录或者太大时按原来的流程处理，其中太大的文件用sendfile发送
     // 通过stat获取请求资源文件信息，成功则将信息更新到m_file_stat结构体
     // 如果函数返回值 < 0，说明资源文件不存在，返回，如果不可读，返回，如果是文件夹，返回
-    if (stat(m_real_file, &m_file_stat) < 0) return NO_RESOURCE;
-    if ((m_file_stat.st_mode & S_IROTH) == 0) return FORBIDDEN_REQUEST;
-    if (S_ISDIR(m_file_stat.st_mode)) return BAD_REQUEST;
+    if (stat(m_real_file, m_file_stat) < 0) return NO_RESOURCE;
+    if ((m_file_stat->st_mode & S_IROTH) == 0) return FORBIDDEN_REQUEST;
+    if (S_ISDIR(m_file_stat->st_mode)) return BAD_REQUEST;
+
+#ifdef SENDFILE
+    // 发送时由内核从页缓存直接拷贝到socket，文件保持打开直到发送完毕
+    if (!m_notifier) {
+        m_file_fd = open(m_real_file, O_RDONLY);
+        if (m_file_fd < 0) return NO_RESOURCE;
+        return FILE_REQUEST;
+    }
+#endif
 
     // 确认一切正常后，通过只读方式打开该文件，映射到内存区，注意要把void*返回类型转换为char*，最后关闭文件描述符
     int fd = open(m_real_file, O_RDONLY);
-    m_file_address = (char *)mmap(0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    m_file_address = (char *)mmap(0, m_file_stat->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
     close(fd);
 
     // 文件资源存在时，返回该值
     return FILE_REQUEST;
 }
 
+// 原文件和预压缩文件都只从文件缓存中取，不增加系统调用；大于缓存上限的文件不压缩
+void http_conn::map_encoded() {
+    const char *path = m_real_file + strlen(doc_root);
+    if (!compressible(path)) return;
+    const char *accept_encoding = header(HDR_ACCEPT_ENCODING);
+    int len = strlen(m_real_file);
+    for (size_t i = 0; i < sizeof(precompressed_files) / sizeof(precompressed_files[0]); ++i) {
+        const precompressed &p = precompressed_files[i];
+        if (len + strlen(p.suffix) >= FILENAME_LEN || !accepts_encoding(accept_encoding, p.encoding)) continue;
+        strcpy(m_real_file + len, p.suffix);
+        cached_file *file = file_cache::GetInstance()->acquire(m_real_file);
+        // m_real_file保持原文件的路径，Cache-Control等仍按原文件匹配
+        m_real_file[len] = '\0';
+        if (!file) continue;
+        // 压缩文件比原文件旧，说明原文件修改后还没有重新压缩，不使用
+        if (file->st.st_mtime < m_file_stat->st_mtime) {
+            file_cache::GetInstance()->release(file);
+            continue;
+        }
+        unmap();
+        m_cache_file = file;
+        *m_file_stat = file->st;
+        m_file_address = file->data;
+        m_content_encoding = p.encoding;
+        return;
+    }
+
+#ifdef COMPRESS
+    // 没有预压缩文件时动态压缩，太小的文件不压缩，压缩结果不变小时发送原文件
+    if (m_file_stat->st_size < COMPRESS_MIN_SIZE) return;
+    for (size_t i = 0; i < sizeof(dynamic_encodings) / sizeof(dynamic_encodings[0]); ++i) {
+        if (!accepts_encoding(accept_encoding, dynamic_encodings[i])) continue;
+        compressed_file *file = compress_cache::GetInstance()->acquire(m_real_file, *m_file_stat, m_file_address, dynamic_encodings[i]);
+        if (!file) return;
+        unmap();
+        m_compressed_file = file;
+        *m_file_stat = file->st;
+        m_file_address = file->data;
+        m_content_encoding = dynamic_encodings[i];
+        return;
+    }
+#endif
+}
+
+// 异步注册的插入语句执行完成，在数据库线程中调用
+void http_conn::register_done(void *arg, int err) {
+    register_ctx *ctx = (register_ctx *)arg;
+    // 插入失败时释放提交前占住的用户名
+    if (err) users.erase(ctx->name.c_str());
+    // 连接由事件循环线程和工作线程处理，这里不访问它，交回所属的事件循环核对代数，再由工作线程生成响应
+    ctx->owner->complete(ctx->conn, ctx->gen, err ? "/registerError.html" : "/log.html");
+    delete ctx;
+}
+
+bool http_conn::resume(unsigned gen, const char *page) {
+    if (m_cold->gen != gen || !m_req) return false;
+    m_req->finish_page = page;
+    return true;
+}
+
+// 以page为目标文件生成响应报文，与process中得到解析结果后的处理相同
+void http_conn::finish_request(const char *page) {
+    strcpy(m_url, page);
+    strcat(m_real_file, m_url);
+    if (!process_write(map_file())) {
+        close_conn();
+        return;
+    }
+    end_request();
+    rearm(EPOLLOUT);
+}
+
 // 从状态机读取一行，分析该行内容，找关键换行字符"\r\n"，返回值有LINE_OK LINE_BAD LINE_OPEN
 http_conn::LINE_STATUS http_conn::parse_line() {
     char tmp;
     // 注意这里条件m_checked_idx < m_read_idx，因为m_read_idx是已经读取数据的下一个位置，m_checked_idx大小不能等于它
-    for (; m_checked_idx < m_read_idx; ++m_checked_idx) {
+    // 向量化地跳过不含'\r'和'\n'的字节，一次16~32个，停在第一个'\r'或'\n'上，没有时停在m_read_idx
+    while ((m_checked_idx = scan_any(m_read_buf + m_checked_idx, m_read_buf + m_read_idx, '\r', '\n') - m_read_buf) < m_read_idx) {
         tmp = m_read_buf[m_checked_idx];
         // 如果是'\r'可能读取到完整行
         if (tmp == '\r') {
@@ -719,32 +1457,51 @@ http_conn::LINE_STATUS http_conn::parse_line() {
 
 // 取消内存映射，利用munmap函数释放，记得释放后将原字符串设置为空
 void http_conn::unmap() {
-    if (m_file_address) {
-        munmap(m_file_address, m_file_stat.st_size);
+    // 排队的流水线响应持有的缓存项
+    for (int i = 0; i < m_queued_count; ++i) {
+        if (m_queued[i].compressed) compress_cache::GetInstance()->release(m_queued[i].compressed);
+        else if (m_queued[i].cache) file_cache::GetInstance()->release(m_queued[i].cache);
+    }
+    m_queued_count = 0;
+    // 来自压缩缓存和文件缓存的内容只归还引用，由缓存决定何时释放
+    if (m_compressed_file) {
+        compress_cache::GetInstance()->release(m_compressed_file);
+        m_compressed_file = NULL;
+        m_file_address = NULL;
+    } else if (m_cache_file) {
+        file_cache::GetInstance()->release(m_cache_file);
+        m_cache_file = NULL;
+        m_file_address = NULL;
+    } else if (m_file_fd >= 0) {
+        close(m_file_fd);
+        m_file_fd = -1;
+    } else if (m_file_address) {
+        munmap(m_file_address, m_file_stat->st_size);
         m_file_address = NULL;
     }
 }
 
 // 写入响应报文主函数，借助可变参数列表实现响应报文行/头部/体的不同输出格式
 bool http_conn::add_response(const char *format, ...) {
-    // 如果当前写位置大于缓冲区长度，返回false
-    if (m_write_idx >= WRITE_BUFFER_SIZE) return false;
+    if (!m_write_buf && !grow_write_buf()) return false;
 
     // 创建可变参数列表，注意va_start必须和va_end成对使用，创建并释放列表
     va_list arg_list;
-    va_start(arg_list, format);
     // 调用vsnprintf，功能和snprintf相同，都是输出长度size的字符到m_write_buf中，只不过vsnprintf可输出可变参数列表
-    // size是当前写缓冲区的剩余空间，WRITE_BUFFER_SIZE - m_write_idx - 1
+    // size是当前写缓冲区的剩余空间，m_write_size - m_write_idx - 1
     // 改动5
-    int len = vsnprintf(m_write_buf + m_write_idx, WRITE_BUFFER_SIZE - m_write_idx - 1, format, arg_list);
-    if (len >= WRITE_BUFFER_SIZE - m_write_idx - 1) {
-        // 如果输出长度大于size，返回false
+    while (true) {
+        va_start(arg_list, format);
+        int len = vsnprintf(m_write_buf + m_write_idx, m_write_size - m_write_idx - 1, format, arg_list);
         va_end(arg_list);
-        return false;
+        if (len < m_write_size - m_write_idx - 1) {
+            // 记得更新写位置
+            m_write_idx += len;
+            break;
+        }
+        // 如果输出长度大于size，换成更大的写缓冲区重新输出，已到上限时返回false
+        if (!grow_write_buf()) return false;
     }
-    // 记得更新写位置
-    m_write_idx += len;
-    va_end(arg_list);
     LOG_INFO("add_response:%s", m_write_buf);
     Log::get_instance()->flush();
     return true;
@@ -756,7 +1513,7 @@ bool http_conn::add_status_line(int status, const char *title) {
 }
 
 // 添加响应报文状态头部，由于头部包含不同信息，封装到一个函数中，个人改写了一下
-bool http_conn::add_headers(int content_length) {
+bool http_conn::add_headers(off_t content_length) {
     // 改动5
     add_content_length(content_length);
     add_linger();
@@ -768,8 +1525,8 @@ bool http_conn::add_headers(int content_length) {
 }
 
 // 添加响应报文状态头部中的响应报文长度信息，源代码中Content-Length:后面好像少了个空格
-bool http_conn::add_content_length(int content_length) {
-    return add_response("Content-Length: %d\r\n", content_length);
+bool http_conn::add_content_length(off_t content_length) {
+    return add_response("Content-Length: %lld\r\n", (long long)content_length);
 }
 
 // 添加响应报文状态头部中的连接状态
@@ -782,6 +1539,25 @@ bool http_conn::add_content_type() {
     return add_response("Content-Type: text/html\r\n");
 } 
 
+// 添加文件响应的缓存相关头部，浏览器下次请求时带上ETag和Last-Modified，由not_modified判断是否返回304
+bool http_conn::add_file_headers() {
+    char etag[40], date[40];
+    format_etag(etag, sizeof(etag), *m_file_stat);
+    format_http_date(date, sizeof(date), m_file_stat->st_mtime);
+    if (!add_response("ETag: %s\r\nLast-Modified: %s\r\n", etag, date)) return false;
+    if (m_content_encoding && !add_response("Content-Encoding: %s\r\n", m_content_encoding)) return false;
+    // 按文件相对网站根目录的路径匹配规则
+    const char *path = m_real_file + strlen(doc_root);
+    // 可压缩的文件不论这次是否压缩都要带Vary，避免中间缓存把压缩文件发给不支持的浏览器
+    if (compressible(path) && !add_response("Vary: Accept-Encoding\r\n"))
+        return false;
+    for (size_t i = 0; i < sizeof(cache_rules) / sizeof(cache_rules[0]); ++i) {
+        if (fnmatch(cache_rules[i].pattern, path, 0) == 0)
+            return add_response("Cache-Control: %s\r\n", cache_rules[i].value);
+    }
+    return true;
+}
+
 // 添加空白行，不知道不写%s直接返回\r\n行不行，个人觉得可以
 bool http_conn::add_blank_line() {
     return add_response("\r\n");
@@ -20,24 +20,60 @@
 #include <error.h>
 #include <sys/wait.h>
 #include <sys/uio.h>
+#include <atomic>
 #include "../lock/locker.h"
 #include "../CGI_MySQL/sql_connection_pool.h"
+#include "../CGI_MySQL/sql_async.h"
+#include "../cache/file_cache.h"
+#include "../cache/compress_cache.h"
+#include "../buffer/buffer_pool.h"
+#include "header_table.h"
 
-class http_conn {
+class http_conn;
+
+// I/O后端通知接口，io_uring等非epoll后端由事件循环自己提交读写请求
+// 工作线程处理完请求后不再调用modfd，而是通过该接口通知连接所属的事件循环
+class io_notifier {
+public:
+    virtual ~io_notifier() {}
+    // ev为EPOLLIN表示需要继续读取，EPOLLOUT表示响应报文已就绪，0表示需要关闭连接
+    virtual void notify(http_conn *conn, int ev) = 0;
+};
+
+// 连接所属的事件循环，数据库线程完成异步查询后通过它把连接交回事件循环线程
+class conn_owner {
+public:
+    virtual ~conn_owner() {}
+    // 异步查询等待期间pending为true，定时器到期时顺延而不关闭连接，可在任何线程调用
+    virtual void set_pending(http_conn *conn, bool pending) = 0;
+    // 数据库线程调用，事件循环线程核对连接代数后把连接交给工作线程，以page为目标文件生成响应
+    virtual void complete(http_conn *conn, unsigned gen, const char *page) = 0;
+};
+
+class alignas(64) http_conn {
 public:
     // 读取文件名m_real_file的最大长度
     static const int FILENAME_LEN = 200;
-    // 读缓冲区m_read_buf的长度
+    // 读缓冲区m_read_buf的初始长度，放不下时从内存池换成两倍大的，直到buffer_pool的上限
     static const int READ_BUFFER_SIZE = 2048;
-    // 写缓冲区m_write_buf的长度
+    // 写缓冲区m_write_buf的初始长度，增长方式同上
     static const int WRITE_BUFFER_SIZE = 1024;
+    // 一次Range请求最多返回的区间数，每个区间的分段头部都写在m_write_buf中，区间更多时返回整个文件
+    static const int MAX_RANGES = 6;
+    // 流水线请求一次最多合并发送的响应数
+    static const int MAX_PIPELINE = 4;
+    // m_write_buf剩余空间不少于该值时才继续处理下一个流水线请求，足够写下除多区间Range以外任一响应的头部
+    static const int RESPONSE_RESERVE = 384;
+    // m_iv的长度，前面排队的每个响应占2个，最后一个响应最多占2 * MAX_RANGES + 1个
+    static const int MAX_IOV = 2 * MAX_RANGES + 2 * MAX_PIPELINE - 1;
 
     // http请求报文的9中请求方法，这里只用到GET和POST两种
     enum METHOD {GET = 0, POST, HEAD, PUT, DELETE, TRACE, OPTIONS, CONNECT, PATH};
     // 主状态机的三种状态，解析请求行（第一行）/解析请求头部/解析请求体（GET报文没有请求体）
     enum CHECK_STATE {CHECK_STATE_REQUESTLINE = 0, CHECK_STATE_HEADER, CHECK_STATE_CONTENT};
     // http请求报文解析结果的返回值，不知道为什么源代码中只有这个第一位没设置为0
-    enum HTTP_CODE {NO_REQUEST = 0, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION};   
+    // PENDING_REQUEST表示注册请求已提交给异步数据库查询，响应报文在查询完成后生成
+    enum HTTP_CODE {NO_REQUEST = 0, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION, PENDING_REQUEST, NOT_IMPLEMENTED};   
     // 从状态机的三种状态，成功读取一行/读取失败/等待继续读取
     enum LINE_STATUS {LINE_OK = 0, LINE_BAD, LINE_OPEN}; 
 
@@ -52,30 +88,70 @@ public:
     Makefile:2: recipe for target 'server' failed
     make: *** [server] Error 1
     */
-    http_conn() {}
-    ~http_conn() {}
+    http_conn() : m_read_buf(NULL), m_read_size(0), m_req(NULL), m_real_file(NULL), m_write_buf(NULL), m_write_size(0),
+                  m_file_address(NULL), m_cache_file(NULL), m_compressed_file(NULL), m_file_fd(-1), m_queued_count(0),
+                  m_resp(NULL), m_iv(NULL), m_file_stat(NULL), m_ranges(NULL), m_queued(NULL), m_cold(NULL) {}
+    ~http_conn() {delete m_cold;}
 
 public:
-    // 初始化套接字地址，内部会调用私有成员函数init()
-    void init(int sockfd, const sockaddr_in &addr);
+    // 初始化套接字地址，epollfd为该连接所属事件循环的内核事件表，owner为所属的事件循环，内部会调用私有成员函数init()
+    // notifier不为空时表示连接由非epoll的I/O后端管理，不再注册到内核事件表中
+    void init(int sockfd, const sockaddr_in &addr, int epollfd, conn_owner *owner, io_notifier *notifier = NULL);
     // 关闭http连接
     void close_conn(bool real_close = true);
 
     // 处理客户请求，也就是threadpool中模板类run()中调用的模板T的成员函数
     void process();
-    // 一次性非阻塞地读取浏览器发来的全部数据
-    bool read_once();
+    // 一次性非阻塞地读取浏览器发来的全部数据，scratch为所属事件循环的临时缓冲区
+    // 没有挂上读缓冲区时先读入scratch，读到数据才从内存池取得读缓冲区
+    bool read_once(char *scratch, int scratch_size);
     // 响应报文写入函数，非阻塞
     bool write();
 
+    // 以下函数供io_uring后端使用，读写系统调用由事件循环提交，这里只负责搬运数据和更新发送进度
+    // 将后端读到的数据追加到m_read_buf，缓冲区增长到上限也放不下时返回false
+    bool read_buffer(const char *data, int len);
+    // 已发送bytes字节后更新发送进度，返回值含义与write相同，bytes_to_send() > 0时需继续发送
+    bool write_done(int bytes);
+    struct iovec* get_iovec(int &iv_count) {iv_count = m_iv_count - m_iv_idx; return m_iv + m_iv_idx;}
+    off_t bytes_to_send() const {return m_bytes_to_send;}
+    bool is_linger() const {return m_keep_alive;}
+    // 读缓冲区中还有没解析的数据，即客户端流水线发来的后续请求，响应发送完后应交给工作线程继续处理，不必等待新的数据
+    bool has_buffered_request() const {return m_checked_idx < m_read_idx;}
+    int get_sockfd() const {return m_sockfd;}
+
     // 新增的两个额外函数，这个get_address用过吗？答：在主函数中用过一次  （和公众号写的不太一样，少了一个函数）
-    sockaddr_in* get_address() {return &m_address;}
+    sockaddr_in* get_address() {return &m_cold->address;}
+    // 异步查询完成后由事件循环线程调用，连接代数仍为gen时记下page，之后交给工作线程的process生成响应
+    bool resume(unsigned gen, const char *page);
     // 同步线程池初始化数据库读取表
     void initmysql_result(connection_pool *connPool);
 
 private:
     // 内部的私有初始化调用
     void init();
+    // 开始解析下一个请求前重置解析状态，不改动读缓冲区中的数据
+    void init_request();
+    // 响应全部发送完后重置写缓冲区和iovec
+    void init_response();
+    // 一个请求的响应生成后调用：记下是否保持连接，丢弃读缓冲区中已处理的请求，把后续的流水线请求移到开头
+    void end_request();
+    // 读缓冲区中还有请求、且当前响应可以与之后的响应合并发送时，把当前响应持有的缓存项移入m_queued，返回true
+    bool queue_response();
+    // 请求报文格式错误或请求体的边界无法确定（如Transfer-Encoding），无法确定下一个请求的起点，响应后关闭连接
+    HTTP_CODE bad_request(HTTP_CODE code = BAD_REQUEST) {m_linger = false; return code;}
+    // 读缓冲区为空时从内存池分配，否则换成两倍大的，已到上限时返回false
+    bool grow_read_buf();
+    // 换成不小于size的读缓冲区，搬移数据并修正指向它的指针；没有读缓冲区时同时挂上m_req
+    bool resize_read_buf(int size);
+    // 写缓冲区的增长方式同上，并修正m_iv中指向它的内存块
+    bool grow_write_buf();
+    // 把读缓冲区（连同m_req）或写缓冲区还给内存池，空闲的长连接不占用缓冲区
+    void free_read_buf();
+    void free_write_buf();
+    // 挂上或归还m_resp
+    bool attach_response();
+    void free_response();
 
     // 从m_read_buf读取，处理解析http请求报文
     HTTP_CODE process_read();
@@ -91,6 +167,15 @@ private:
     HTTP_CODE parse_content(char *text);
     // 生成响应报文
     HTTP_CODE do_request();
+    // 获取m_real_file的文件信息和内容，优先从文件缓存中获取，否则映射到内存，do_request和异步注册完成后调用
+    HTTP_CODE map_file();
+    // 异步注册的插入语句执行完成后由数据库线程调用，arg为register_ctx，只把结果交回连接所属的事件循环
+    static void register_done(void *arg, int err);
+    // 异步注册完成后在工作线程中调用，以page为目标文件生成响应报文并注册写事件
+    void finish_request(const char *page);
+
+    // 请求头部中字段id的值，parse_header已在值的末尾写入'\0'，可直接当作C字符串使用，没有该字段时为NULL
+    const char* header(header_id id) const {return m_req->headers.get(id).data();}
 
     // 用于将文件内容指针向后偏移，指向未处理的字符，m_start_line是已经解析的字符
     char* get_line() {return m_read_buf + m_start_line;}
@@ -98,80 +183,168 @@ private:
     // 从状态机读取一行，分析该行内容，判断是请求报文的哪一部分
     LINE_STATUS parse_line();
 
+    // 重新注册EPOLLONESHOT事件，非epoll后端则通知所属事件循环
+    void rearm(int ev);
+    // writev成功写出bytes字节后更新iovec
+    void update_iovec(int bytes);
+    // 解析Range字段，按起点排序并合并重叠或相邻的区间，存入m_ranges
+    // 返回区间数，返回0表示忽略Range返回整个文件（格式错误或区间太多），返回-1表示没有可满足的区间
+    int parse_range();
+    // 生成206响应：单个区间直接返回该区间，多个区间返回multipart/byteranges，m_write_buf写不下时返回false
+    bool add_ranges(int n);
+    // 让m_iv[m_iv_base + 2 * i + 1]指向第i个文件区间
+    void file_iovec(int i);
+    // 根据If-None-Match和If-Modified-Since判断浏览器缓存的文件是否仍然有效，有效时返回304
+    bool not_modified();
+    // 根据If-Range判断Range是否有效，文件已被修改时应忽略Range返回整个文件
+    bool range_valid();
+    // 浏览器接受压缩时改为发送压缩文件：优先使用预压缩的同名.br/.gz文件，没有时动态压缩
+    void map_encoded();
+
     // 下面这些函数被process_write调用，用以填充http响应报文
+    // 释放响应正文占用的资源：归还压缩缓存或文件缓存（包括排队的流水线响应持有的）、munmap或者关闭sendfile使用的文件
     void unmap();
 
     // 下面8个函数由do_request调用，根据响应报文格式生成8个部分
     bool add_response(const char *format, ...);
     bool add_status_line(int status, const char *title);
-    bool add_headers(int content_length);
-    bool add_content_length(int content_length);
+    bool add_headers(off_t content_length);
+    bool add_content_length(off_t content_length);
     bool add_linger();
     bool add_content_type();    // 新增函数，但是源代码里没用过，离谱，我自己用吧
     bool add_blank_line();
+    // 添加文件响应共有的头部：ETag、Last-Modified、按路径配置的Cache-Control，以及Content-Encoding和Vary
+    bool add_file_headers();
     bool add_content(const char *content);
 
 public:
-    // 所有socket上的事件都被注册到同一个epoll内核事件表中，所以将epollfd设置为静态成员变量
-    static int m_epollfd;
-    // 统计用户数量
-    static int m_user_count;
-    // 新增的MYSQL类型成员变量
-    MYSQL* m_mysql;
+    // 统计用户数量，多个事件循环和工作线程会同时修改，故使用原子变量
+    static std::atomic<int> m_user_count;
+    // 数据库连接池，initmysql_result时记录，注册请求按需从中获取连接
+    static connection_pool *m_conn_pool;
 
 private:
-    // 该http连接的sockfd和对方的socket地址
+    // 成员按处理请求时的访问顺序排列，先是读取和解析请求的字段，再是生成和发送响应的字段，整个对象256字节，正好4个缓存行
+    // users数组中相邻的连接常由不同线程同时处理（事件循环读写一个、工作线程解析另一个），按缓存行对齐后相邻的连接不会共用缓存行
+    // 只在建立连接和注册请求时用到的字段放在单独分配的m_cold中，解析请求和发送响应用到的大块状态见request_state和response_state
+
+    // 以下是读取和解析请求时访问的字段
+    // 该http连接的sockfd
     int m_sockfd;
-    sockaddr_in m_address;      // 这个变量其实没啥卵用
-    
-    // 读缓冲区的http请求报文数据
-    char m_read_buf[READ_BUFFER_SIZE];
+    // 该连接所属事件循环的内核事件表，多事件循环模式下各个连接不再共用同一个epollfd
+    int m_epollfd;
+    // 非epoll后端的通知接口，epoll后端为NULL
+    io_notifier *m_notifier;
+    // 读缓冲区的http请求报文数据，没有未处理的数据时为NULL
+    char *m_read_buf;
+    int m_read_size;
     // m_read_buf数据中一次性读取数据的最后一个字节的下一个位置，应该是最大的值
     int m_read_idx;
     // m_read_buf中已经读取到的字节总数，应为是三个数中间值  Q:这三个参数的关系和区别？
     int m_checked_idx;
     // 表示即将解析的行的起始位置，应是最小值
     int m_start_line;
-
-    // 写缓冲区的数据
-    char m_write_buf[WRITE_BUFFER_SIZE];
-    // m_write_buf中待发送的字节数
-    int m_write_idx;
-
     // 主状态机当前状态
     CHECK_STATE m_check_state;
     // 请求方法类型
     METHOD m_method;
 
-    // 客户请求目标文件的完整路径，其内容等于doc_root + m_url，doc_root是网站根目录
-    char m_real_file[FILENAME_LEN];
+    // 只在解析和处理一个请求期间使用的状态，与读缓冲区一起从内存池取得、一起归还
+    struct request_state {
+        // 请求头部的全部字段，值指向m_read_buf
+        header_table headers;
+        // 客户请求目标文件的完整路径，其内容等于doc_root + m_url，doc_root是网站根目录
+        char real_file[FILENAME_LEN];
+        // 是否启用的POST
+        int cgi;
+        // 存储用户名和密码信息
+        char *user_data;
+        // 异步注册完成后要返回的页面，由事件循环设置，process据此直接生成响应
+        const char *finish_page;
+    };
+    // 没有挂上读缓冲区时为NULL
+    request_state *m_req;
+    // 指向m_req->real_file
+    char *m_real_file;
     // 客户请求的目标文件名称
     char *m_url;
     // http版本协议号，仅支持HTTP/1.1
     char *m_version;
-    // 主机名
-    char *m_host;
     // http请求报文请求'体'的长度
     int m_content_length;
     // http请求是否要保持连接
     bool m_linger;
-    // 客户请求的目标文件被内存映射到的起始位置
+    // 最后生成的响应是否保持连接，m_linger在解析下一个流水线请求时会被重置，发送完毕后按该值决定是否关闭连接
+    bool m_keep_alive;
+
+    // 以下是生成和发送响应时访问的字段
+    // 写缓冲区的数据，没有待发送的响应时为NULL
+    char *m_write_buf;
+    int m_write_size;
+    // m_write_buf中待发送的字节数
+    int m_write_idx;
+    // 客户请求的目标文件被内存映射到的起始位置，命中文件缓存时指向缓存中的文件内容
     char *m_file_address;
-    // 目标文件的信息，用来判断文件是否存在、是否为目录、是否可读，并获取文件大小等信息
-    struct stat m_file_stat;
-    // 采用writev来执行写操作，故定义io向量，m_iv_count表示被写内存块的数量
-    struct iovec m_iv[2];
+    // 命中文件缓存时持有的缓存项，发送完后在unmap中release，未命中时为NULL
+    cached_file *m_cache_file;
+    // 发送动态压缩的结果时持有的压缩缓存项，发送完后在unmap中release
+    compressed_file *m_compressed_file;
+    // 用sendfile发送时打开的文件，不用sendfile时为-1
+    int m_file_fd;
+    // 排在当前响应之前、等待一起发送的流水线响应持有的缓存项，发送完后在unmap中release
+    // 正文用sendfile或mmap发送的响应只能是最后一个，排队的响应正文都在缓存中或者没有正文
+    struct queued_response {
+        cached_file *cache;
+        compressed_file *compressed;
+    };
+    int m_queued_count;
+    // 要发送的文件区间[begin, end)，不是Range请求时只有整个文件一个区间
+    struct file_range {
+        off_t begin;
+        off_t end;
+    };
+    // 生成和发送响应期间使用的状态，process开始时从内存池取得，响应全部发送完后归还
+    struct response_state {
+        struct iovec iv[MAX_IOV];
+        file_range ranges[MAX_RANGES];
+        queued_response queued[MAX_PIPELINE - 1];
+        struct stat file_stat;
+    };
+    // 没有待生成或待发送的响应时为NULL，下面四个指针指向其中的对应成员
+    response_state *m_resp;
+    // 采用writev来执行写操作，故定义io向量，m_iv_count表示被写内存块的数量，m_iv_idx为第一个还没发完的内存块
+    // 排队的流水线响应在前，当前响应从m_iv_base开始：相对m_iv_base的偶数位置指向m_write_buf中的响应报文和分段头部，
+    // 奇数位置m_iv[m_iv_base + 2 * i + 1]指向第i个文件区间
+    // sendfile发送时文件区间没有映射区，iov_base为NULL，iov_len为该区间剩余的长度
+    struct iovec *m_iv;
     int m_iv_count;
-
-    // 下面为新增变量
-    // 是否启用的POST
-    int m_cgi;    
-    // 存储用户名和密码信息
-    char *m_user_data; 
-    // 剩余发送字节数，该值为响应报文长度+内存映射文件长度之和
-    int m_bytes_to_send;
+    int m_iv_idx;
+    int m_iv_base;
+    // 当前响应在m_write_buf中的起点，之前是排队的流水线响应
+    int m_resp_start;
+    // 剩余发送字节数，该值为响应报文长度+内存映射文件长度之和，与文件大小一样用off_t，2GB以上的文件不会溢出
+    off_t m_bytes_to_send;
     // 已发送字节数
-    int m_bytes_have_sent;
+    off_t m_bytes_have_sent;
+    // 目标文件的信息，用来判断文件是否存在、是否为目录、是否可读，并获取文件大小等信息
+    struct stat *m_file_stat;
+    file_range *m_ranges;
+    queued_response *m_queued;
+    // 发送预压缩文件时的Content-Encoding，发送原文件时为NULL
+    const char *m_content_encoding;
+
+    // 不常用的字段，第一次init(sockfd...)时分配，fd被复用时继续使用，析构时释放
+    struct conn_cold {
+        // 对方的socket地址
+        sockaddr_in address;
+        // 只在注册请求处理期间持有连接池中的连接，其余时间为NULL
+        MYSQL *mysql;
+        // 连接的代数，每次init(sockfd...)时递增，异步查询完成时据此判断连接是否已被关闭并复用
+        std::atomic<unsigned> gen;
+        // 所属的事件循环
+        conn_owner *owner;
+    };
+    conn_cold *m_cold;
 };
 
 #endif
\ No newline at end of file
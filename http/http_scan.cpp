@@ -0,0 +1,115 @@
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+#include "http_scan.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+const char *const header_names[HDR_COUNT] = {
+    "Host", "Connection", "Content-Length", "Content-Type", "Transfer-Encoding", "Expect",
+    "Range", "If-Range", "If-None-Match", "If-Modified-Since", "If-Match", "If-Unmodified-Since",
+    "Accept", "Accept-Encoding", "Accept-Language", "Accept-Charset", "User-Agent", "Referer", "Cookie",
+    "Cache-Control", "Pragma", "Origin", "Upgrade-Insecure-Requests", "Upgrade", "DNT", "Authorization",
+    "Sec-Fetch-Site", "Sec-Fetch-Mode", "Sec-Fetch-Dest", "Sec-Fetch-User",
+    "Sec-CH-UA", "Sec-CH-UA-Mobile", "Sec-CH-UA-Platform",
+    "X-Forwarded-For", "X-Requested-With", "TE", "Priority", "Keep-Alive",
+};
+
+// 乘法哈希的乘数，由穷举搜索得到，保证header_names中的字段名互不冲突；增加字段名后需要重新搜索
+#define HEADER_HASH_SEED 0x10170d2bbf4e302dULL
+#define HEADER_HASH_BITS 7
+
+// 字段名的键：长度和首、中、末两个字符，字母转为小写（其他字符不变或者最后比较时不相等）
+static inline uint64_t header_hash(const char *name, int len) {
+    uint64_t key = (uint64_t)(name[0] | 0x20) | (uint64_t)(name[len / 2] | 0x20) << 8 |
+                   (uint64_t)(name[len - 1] | 0x20) << 16 | (uint64_t)(name[len - 2] | 0x20) << 24 | (uint64_t)len << 32;
+    return (key * HEADER_HASH_SEED) >> (64 - HEADER_HASH_BITS);
+}
+
+// 哈希值到header_id的表，启动时由header_names生成
+struct header_slots {
+    signed char slots[1 << HEADER_HASH_BITS];
+    unsigned char lens[HDR_COUNT];
+    header_slots() {
+        memset(slots, -1, sizeof(slots));
+        for (int i = 0; i < HDR_COUNT; ++i) {
+            lens[i] = strlen(header_names[i]);
+            uint64_t h = header_hash(header_names[i], lens[i]);
+            // 冲突说明HEADER_HASH_SEED已不适用于当前的字段名
+            assert(slots[h] == -1);
+            slots[h] = i;
+        }
+    }
+};
+static const header_slots headers;
+
+header_id lookup_header(const char *name, int len) {
+    if (len < 2) return HDR_UNKNOWN;
+    int id = headers.slots[header_hash(name, len)];
+    if (id < 0 || headers.lens[id] != len || strncasecmp(header_names[id], name, len) != 0) return HDR_UNKNOWN;
+    return (header_id)id;
+}
+
+const char *scan_any_scalar(const char *p, const char *end, char a, char b) {
+    for (; p < end; ++p) {
+        if (*p == a || *p == b) return p;
+    }
+    return end;
+}
+
+#ifdef SCAN_X86
+// 用target属性单独为这两个函数开启指令集，整个程序仍按默认指令集编译，不支持的CPU上不会调用它们
+__attribute__((target("sse4.2")))
+const char *scan_any_sse42(const char *p, const char *end, char a, char b) {
+    // pcmpestri一次比较16个字节是否等于字符集合中的任一字符，返回第一个匹配的位置，没有时返回16
+    const __m128i set = _mm_setr_epi8(a, b, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        int i = _mm_cmpestri(set, 2, v, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+        if (i < 16) return p + i;
+    }
+    // 不足16字节的尾部逐字节查找，不越过end读取
+    return scan_any_scalar(p, end, a, b);
+}
+
+__attribute__((target("avx2")))
+const char *scan_any_avx2(const char *p, const char *end, char a, char b) {
+    // 一次比较32个字节，两个比较结果合并后取出每个字节的最高位，最低的1位就是第一个匹配的位置
+    const __m256i va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b);
+    for (; end - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)));
+        if (mask) return p + __builtin_ctz(mask);
+    }
+    if (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, _mm256_castsi256_si128(va)),
+                                                       _mm_cmpeq_epi8(v, _mm256_castsi256_si128(vb))));
+        if (mask) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    return scan_any_scalar(p, end, a, b);
+}
+
+static scan_fn select_scan() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return scan_any_avx2;
+    if (__builtin_cpu_supports("sse4.2")) return scan_any_sse42;
+    return scan_any_scalar;
+}
+#else
+const char *scan_any_sse42(const char *p, const char *end, char a, char b) {return scan_any_scalar(p, end, a, b);}
+const char *scan_any_avx2(const char *p, const char *end, char a, char b) {return scan_any_scalar(p, end, a, b);}
+static scan_fn select_scan() {return scan_any_scalar;}
+#endif
+
+const scan_fn scan_any = select_scan();
+
+const char *scan_impl_name() {
+    if (scan_any == scan_any_avx2) return "avx2";
+    if (scan_any == scan_any_sse42) return "sse4.2";
+    return "scalar";
+}
@@ -0,0 +1,39 @@
+#ifndef HTTP_SCAN_H
+#define HTTP_SCAN_H
+
+#include <stddef.h>
+
+// 请求报文的扫描工具：向量化地查找行和字段的分隔符，用完美哈希识别字段名
+
+// 浏览器请求中常见的字段名，header_names按此顺序排列
+enum header_id {
+    HDR_UNKNOWN = -1,
+    HDR_HOST = 0, HDR_CONNECTION, HDR_CONTENT_LENGTH, HDR_CONTENT_TYPE, HDR_TRANSFER_ENCODING, HDR_EXPECT,
+    HDR_RANGE, HDR_IF_RANGE, HDR_IF_NONE_MATCH, HDR_IF_MODIFIED_SINCE, HDR_IF_MATCH, HDR_IF_UNMODIFIED_SINCE,
+    HDR_ACCEPT, HDR_ACCEPT_ENCODING, HDR_ACCEPT_LANGUAGE, HDR_ACCEPT_CHARSET, HDR_USER_AGENT, HDR_REFERER, HDR_COOKIE,
+    HDR_CACHE_CONTROL, HDR_PRAGMA, HDR_ORIGIN, HDR_UPGRADE_INSECURE_REQUESTS, HDR_UPGRADE, HDR_DNT, HDR_AUTHORIZATION,
+    HDR_SEC_FETCH_SITE, HDR_SEC_FETCH_MODE, HDR_SEC_FETCH_DEST, HDR_SEC_FETCH_USER,
+    HDR_SEC_CH_UA, HDR_SEC_CH_UA_MOBILE, HDR_SEC_CH_UA_PLATFORM,
+    HDR_X_FORWARDED_FOR, HDR_X_REQUESTED_WITH, HDR_TE, HDR_PRIORITY, HDR_KEEP_ALIVE,
+    HDR_COUNT
+};
+
+extern const char *const header_names[HDR_COUNT];
+
+// 识别长度为len的字段名，大小写不敏感，name不必以'\0'结尾，不是上面的字段时返回HDR_UNKNOWN
+// 由字段长度和首、中、末两个字符算出哈希值，常见字段名在128个槽中没有冲突，查一次表再比较一次字符串即可
+header_id lookup_header(const char *name, int len);
+
+// 在[p, end)中查找第一个等于a或b的字节，找不到时返回end，只读取[p, end)范围内的内存
+typedef const char *(*scan_fn)(const char *p, const char *end, char a, char b);
+// 启动时按CPU支持的指令集选择AVX2（一次32字节）、SSE4.2（一次16字节）或逐字节的实现
+extern const scan_fn scan_any;
+// 选中的实现的名称
+const char *scan_impl_name();
+
+// 各个实现，供测试对比，CPU不支持的实现不能调用
+const char *scan_any_scalar(const char *p, const char *end, char a, char b);
+const char *scan_any_sse42(const char *p, const char *end, char a, char b);
+const char *scan_any_avx2(const char *p, const char *end, char a, char b);
+
+#endif
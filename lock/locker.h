@@ -53,6 +53,10 @@ public:
         // pthread_mutex_unlock(&m_mutex);
         return res == 0;
     }
+    // 等到被唤醒或超过绝对时间t，超时返回false
+    bool timewait(pthread_mutex_t *m_mutex, struct timespec t) {
+        return pthread_cond_timedwait(&m_cond, m_mutex, &t) == 0;
+    }
     bool signal() {
         return pthread_cond_signal(&m_cond) == 0;
     }
@@ -87,6 +91,10 @@ public:
         // V操作，当前信号量+1
         return sem_post(&m_sem) == 0;
     }
+    // 带超时的P操作，abstime为CLOCK_REALTIME的绝对时间，超时返回false
+    bool timedwait(const struct timespec *abstime) {
+        return sem_timedwait(&m_sem, abstime) == 0;
+    }
 
 private:
     sem_t m_sem;
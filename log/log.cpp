@@ -3,6 +3,8 @@
 #include <sys/time.h>
 #include <cstdarg>
 #include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
 #include "log.h"
 
 using namespace std;
@@ -10,21 +12,44 @@ using namespace std;
 Log::Log()
 {
     m_count = 0;
+    m_fp = NULL;
     m_is_async = false;
+    m_is_buffered = false;
+    m_buffer_size = 0;
+    m_stop = false;
+    m_threads = NULL;
+    m_dropped = 0;
 }
 
 Log::~Log()
 {
+    if (m_is_buffered)
+    {
+        // 通知后台线程把剩下的日志全部写入文件后退出
+        m_buffer_lock.lock();
+        m_stop = true;
+        m_buffer_cond.signal();
+        m_buffer_lock.unlock();
+        pthread_join(m_buffer_tid, NULL);
+    }
     if (m_fp != NULL)
     {
         fclose(m_fp);
     }
 }
 // 异步需要设置阻塞队列的长度，同步不需要设置
-bool Log::init(const char *file_name, int log_buf_size, int split_lines, int max_queue_size)
+bool Log::init(const char *file_name, int log_buf_size, int split_lines, int max_queue_size, int buffer_kb)
 {
+    // 设置了buffer_kb时按线程双缓冲，后台线程在打开日志文件后创建
+    if (buffer_kb > 0)
+    {
+        m_is_buffered = true;
+        // 缓冲区至少能放下4行最长的日志
+        m_buffer_size = buffer_kb << 10;
+        if (m_buffer_size < 4 * log_buf_size) m_buffer_size = 4 * log_buf_size;
+    }
     // 如果设置了max_queue_size,则设置为异步
-    if (max_queue_size >= 1)
+    else if (max_queue_size >= 1)
     {
         // 设置写入方式flag
         m_is_async = true;
@@ -75,16 +100,43 @@ bool Log::init(const char *file_name, int log_buf_size, int split_lines, int max
         return false;
     }
 
+    if (m_is_buffered && pthread_create(&m_buffer_tid, NULL, flush_buffer_thread, NULL) != 0)
+    {
+        m_is_buffered = false;
+    }
     return true;
 }
 
+void Log::open_next(const struct tm &my_tm)
+{
+    char new_log[256] = {0};
+    fflush(m_fp);
+    fclose(m_fp);
+    char tail[16] = {0};
+
+    // 格式化日志名中的时间部分
+    snprintf(tail, 16, "%d_%02d_%02d_", my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday);
+
+    // 如果是时间不是今天,则创建今天的日志，更新m_today和m_count
+    if (m_today != my_tm.tm_mday)
+    {
+        snprintf(new_log, 255, "%s%s%s", dir_name, tail, log_name);
+        m_today = my_tm.tm_mday;
+        m_count = 0;
+    }
+    else
+    {
+        // 超过了最大行，在之前的日志名基础上加后缀, m_count/m_split_lines
+        snprintf(new_log, 255, "%s%s%s.%lld", dir_name, tail, log_name, m_count / m_split_lines);
+    }
+    m_fp = fopen(new_log, "a");
+}
+
 void Log::write_log(int level, const char *format, ...)
 {
     struct timeval now = {0, 0};
     gettimeofday(&now, NULL);
     time_t t = now.tv_sec;
-    struct tm *sys_tm = localtime(&t);
-    struct tm my_tm = *sys_tm;
     char s[16] = {0};
 
     // 日志分级
@@ -106,6 +158,18 @@ void Log::write_log(int level, const char *format, ...)
         strcpy(s, "[info]:");
         break;
     }
+
+    if (m_is_buffered)
+    {
+        va_list valst;
+        va_start(valst, format);
+        buffer_append(s, now, format, valst);
+        va_end(valst);
+        return;
+    }
+
+    struct tm *sys_tm = localtime(&t);
+    struct tm my_tm = *sys_tm;
     // 写入一个log，对m_count++, m_split_lines最大行数
     m_mutex.lock();
     m_count++;
@@ -114,28 +178,7 @@ void Log::write_log(int level, const char *format, ...)
     // m_split_lines为最大行数
     if (m_today != my_tm.tm_mday || m_count % m_split_lines == 0) //everyday log
     {
-        
-        char new_log[256] = {0};
-        fflush(m_fp);
-        fclose(m_fp);
-        char tail[16] = {0};
-       
-        // 格式化日志名中的时间部分
-        snprintf(tail, 16, "%d_%02d_%02d_", my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday);
-       
-        // 如果是时间不是今天,则创建今天的日志，更新m_today和m_count   
-        if (m_today != my_tm.tm_mday)
-        {
-            snprintf(new_log, 255, "%s%s%s", dir_name, tail, log_name);
-            m_today = my_tm.tm_mday;
-            m_count = 0;
-        }
-        else
-        {
-            // 超过了最大行，在之前的日志名基础上加后缀, m_count/m_split_lines
-            snprintf(new_log, 255, "%s%s%s.%lld", dir_name, tail, log_name, m_count / m_split_lines);
-        }
-        m_fp = fopen(new_log, "a");
+        open_next(my_tm);
     }
  
     m_mutex.unlock();
@@ -154,7 +197,9 @@ void Log::write_log(int level, const char *format, ...)
                      my_tm.tm_hour, my_tm.tm_min, my_tm.tm_sec, now.tv_usec, s);
     
     // 内容格式化，用于向字符串中打印数据、数据格式用户自定义，返回写入到字符数组str中的字符个数(不包含终止符)
-    int m = vsnprintf(m_buf + n, m_log_buf_size - 1, format, valst);
+    // 剩余空间要留出'\n'和'\0'，超长的内容被截断，vsnprintf返回的是截断前的长度
+    int m = vsnprintf(m_buf + n, m_log_buf_size - n - 1, format, valst);
+    if (m > m_log_buf_size - n - 2) m = m_log_buf_size - n - 2;
     m_buf[n + m] = '\n';
     m_buf[n + m + 1] = '\0';
     log_str = m_buf;
@@ -179,8 +224,259 @@ void Log::write_log(int level, const char *format, ...)
 
 void Log::flush(void)
 {
+    // 按线程双缓冲时不加锁，日志最多延迟LOG_FLUSH_INTERVAL秒写入文件
+    if (m_is_buffered)
+    {
+        return;
+    }
     m_mutex.lock();
     //强制刷新写入流缓冲区
     fflush(m_fp);
     m_mutex.unlock();
-}
\ No newline at end of file
+}
+
+Log::thread_buffer::~thread_buffer()
+{
+    // 弹性线程池缩容、事件循环退出时线程会退出，没写入文件的日志交给后台线程
+    if (registered)
+    {
+        Log::get_instance()->retire(*this);
+    }
+}
+
+Log::thread_buffer &Log::local()
+{
+    static thread_local thread_buffer tb;
+    return tb;
+}
+
+void Log::buffer_append(const char *level, const struct timeval &now, const char *format, va_list valst)
+{
+    thread_buffer &tb = local();
+    if (!tb.registered)
+    {
+        // 线程第一次写日志，加入链表后后台线程才会定期取走它的日志
+        tb.cur = new char[m_buffer_size];
+        tb.spare = new char[m_buffer_size];
+        m_list_lock.lock();
+        tb.next = m_threads;
+        if (m_threads) m_threads->prev = &tb;
+        m_threads = &tb;
+        m_list_lock.unlock();
+        tb.registered = true;
+    }
+
+    tb.lock.lock();
+    // 剩余空间放不下最长的一行时交给后台线程
+    if (m_buffer_size - tb.len < m_log_buf_size)
+    {
+        submit(tb);
+    }
+    if (tb.sec != now.tv_sec)
+    {
+        time_t t = now.tv_sec;
+        struct tm my_tm;
+        localtime_r(&t, &my_tm);
+        strftime(tb.time_str, sizeof(tb.time_str), "%Y-%m-%d %H:%M:%S", &my_tm);
+        tb.sec = now.tv_sec;
+    }
+    // 与同步日志相同的格式，直接写入线程自己的缓冲区，不需要'\0'；剩余空间至少有m_log_buf_size，与下面的vsnprintf用同一个上限
+    char *p = tb.cur + tb.len;
+    int n = snprintf(p, m_log_buf_size - 1, "%s.%06ld %s ", tb.time_str, now.tv_usec, level);
+    int m = vsnprintf(p + n, m_log_buf_size - n - 1, format, valst);
+    if (m > m_log_buf_size - n - 2) m = m_log_buf_size - n - 2;
+    p[n + m] = '\n';
+    tb.len += n + m + 1;
+    ++tb.lines;
+    tb.lock.unlock();
+}
+
+void Log::submit(thread_buffer &tb)
+{
+    m_buffer_lock.lock();
+    if (m_full.size() >= LOG_MAX_PENDING)
+    {
+        // 磁盘跟不上时丢弃这个缓冲区中的日志，继续使用它，避免内存无限增长
+        m_dropped += tb.lines;
+    }
+    else
+    {
+        m_full.push_back({tb.cur, tb.len, tb.lines});
+        m_buffer_cond.signal();
+        tb.cur = tb.spare;
+        // 从后台线程写完的缓冲区中取一个作为新的备用缓冲区
+        tb.spare = NULL;
+        if (!m_idle.empty())
+        {
+            tb.spare = m_idle.back();
+            m_idle.pop_back();
+        }
+    }
+    m_buffer_lock.unlock();
+
+    if (!tb.cur)
+    {
+        tb.cur = tb.spare;
+        tb.spare = NULL;
+    }
+    // 两块缓冲区都在等待写入，后台线程还没有还回来
+    if (!tb.cur)
+    {
+        tb.cur = new char[m_buffer_size];
+    }
+    tb.len = 0;
+    tb.lines = 0;
+}
+
+void Log::retire(thread_buffer &tb)
+{
+    m_list_lock.lock();
+    if (tb.prev) tb.prev->next = tb.next;
+    else m_threads = tb.next;
+    if (tb.next) tb.next->prev = tb.prev;
+    m_list_lock.unlock();
+
+    // 已从链表中摘下，后台线程不会再访问它
+    m_buffer_lock.lock();
+    if (tb.len > 0)
+    {
+        m_full.push_back({tb.cur, tb.len, tb.lines});
+        m_buffer_cond.signal();
+    }
+    else
+    {
+        m_idle.push_back(tb.cur);
+    }
+    if (tb.spare)
+    {
+        m_idle.push_back(tb.spare);
+    }
+    m_buffer_lock.unlock();
+    tb.cur = tb.spare = NULL;
+    tb.registered = false;
+}
+
+void Log::collect(vector<full_buffer> &full, vector<char *> &idle)
+{
+    m_list_lock.lock();
+    for (thread_buffer *tb = m_threads; tb; tb = tb->next)
+    {
+        tb->lock.lock();
+        if (tb->len > 0)
+        {
+            full.push_back({tb->cur, tb->len, tb->lines});
+            // 优先换上线程自己的备用缓冲区，它下次写满时再从m_idle取
+            if (tb->spare)
+            {
+                tb->cur = tb->spare;
+                tb->spare = NULL;
+            }
+            else if (!idle.empty())
+            {
+                tb->cur = idle.back();
+                idle.pop_back();
+            }
+            else
+            {
+                tb->cur = new char[m_buffer_size];
+            }
+            tb->len = 0;
+            tb->lines = 0;
+        }
+        tb->lock.unlock();
+    }
+    m_list_lock.unlock();
+}
+
+// 写入整个缓冲区，被信号打断或只写了一部分时继续
+static void write_all(FILE *fp, const char *p, int len)
+{
+    while (fp && len > 0)
+    {
+        ssize_t n = write(fileno(fp), p, len);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            return;
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+void Log::write_buffers(vector<full_buffer> &full, vector<char *> &idle)
+{
+    if (full.empty())
+    {
+        return;
+    }
+    time_t t = time(NULL);
+    struct tm my_tm;
+    localtime_r(&t, &my_tm);
+    for (size_t i = 0; i < full.size(); ++i)
+    {
+        // 按缓冲区累计行数，换文件的位置精确到缓冲区而不是行
+        long long before = m_count;
+        m_count += full[i].lines;
+        if (m_today != my_tm.tm_mday || before / m_split_lines != m_count / m_split_lines)
+        {
+            open_next(my_tm);
+        }
+        write_all(m_fp, full[i].buf, full[i].len);
+        idle.push_back(full[i].buf);
+    }
+    full.clear();
+}
+
+void *Log::buffer_write_log()
+{
+    vector<full_buffer> full;
+    vector<char *> idle;
+    time_t last = time(NULL);
+    bool stop = false;
+    while (!stop)
+    {
+        m_buffer_lock.lock();
+        // 写完的缓冲区还给写日志的线程，多余的释放
+        for (size_t i = 0; i < idle.size(); ++i)
+        {
+            if (m_idle.size() < LOG_MAX_IDLE) m_idle.push_back(idle[i]);
+            else delete[] idle[i];
+        }
+        idle.clear();
+        if (m_full.empty() && !m_stop)
+        {
+            struct timespec t = {last + LOG_FLUSH_INTERVAL, 0};
+            m_buffer_cond.timewait(m_buffer_lock.get(), t);
+        }
+        stop = m_stop;
+        full.swap(m_full);
+        long long dropped = m_dropped;
+        m_dropped = 0;
+        m_buffer_lock.unlock();
+
+        // 每隔LOG_FLUSH_INTERVAL秒取走各线程未写满的缓冲区，日志少时也能及时写入文件；退出前全部取走
+        time_t now = time(NULL);
+        if (stop || now - last >= LOG_FLUSH_INTERVAL)
+        {
+            collect(full, idle);
+            last = now;
+        }
+        write_buffers(full, idle);
+
+        if (dropped > 0)
+        {
+            char line[128];
+            struct tm my_tm;
+            localtime_r(&now, &my_tm);
+            int n = snprintf(line, sizeof(line), "%d-%02d-%02d %02d:%02d:%02d.000000 [warn]: %lld log lines dropped, the log file cannot keep up\n",
+                             my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday, my_tm.tm_hour, my_tm.tm_min, my_tm.tm_sec, dropped);
+            write_all(m_fp, line, n);
+        }
+    }
+    for (size_t i = 0; i < idle.size(); ++i)
+    {
+        delete[] idle[i];
+    }
+    return NULL;
+}
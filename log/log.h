@@ -6,10 +6,17 @@
 #include <string>
 #include <cstdarg>
 #include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <vector>
 #include "block_queue.h"
 
 using namespace std;
 
+#define LOG_FLUSH_INTERVAL 1    // 按线程双缓冲时后台线程至少每隔1秒写一次文件
+#define LOG_MAX_IDLE 16         // 按线程双缓冲时最多保留的空闲缓冲区数
+#define LOG_MAX_PENDING 64      // 等待写入的缓冲区超过该数时丢弃新写满的缓冲区
+
 class Log {
 public:
     // C++11以后,使用局部变量懒汉不用加锁
@@ -25,13 +32,21 @@ public:
         Log::get_instance()->async_write_log();
     }
 
+    // 按线程双缓冲的后台线程，调用私有方法buffer_write_log
+    static void *flush_buffer_thread(void *args)
+    {
+        Log::get_instance()->buffer_write_log();
+        return NULL;
+    }
+
     // 可选择的参数有日志文件、日志缓冲区大小、最大行数以及最长日志条队列
-    bool init(const char *file_name, int log_buf_size = 8192, int split_lines = 5000000, int max_queue_size = 0);
+    // buffer_kb大于0时使用按线程双缓冲的异步日志，每个线程的缓冲区为buffer_kb KB，忽略max_queue_size
+    bool init(const char *file_name, int log_buf_size = 8192, int split_lines = 5000000, int max_queue_size = 0, int buffer_kb = 0);
 
     // 将输出内容按照标准格式整理
     void write_log(int level, const char *format, ...);
 
-    // 强制刷新缓冲区
+    // 强制刷新缓冲区，按线程双缓冲时由后台线程定期写入，直接返回
     void flush(void);
 
 private:
@@ -51,6 +66,42 @@ private:
         }
     }
 
+    // 日志不是今天或行数达到m_split_lines的倍数时换一个日志文件
+    void open_next(const struct tm &my_tm);
+
+    // 按线程双缓冲：每个线程把日志追加到自己的缓冲区，写满后交给后台线程并换上备用的缓冲区
+    // 写日志时只锁自己的缓冲区，只有后台线程定期取走未写满的缓冲区时才会争用
+    struct thread_buffer {
+        locker lock;
+        bool registered;            // 只由线程自己读写，后台线程会替换cur
+        char *cur;                  // 正在追加的缓冲区，第一次写日志时分配
+        int len;
+        int lines;
+        char *spare;                // 备用的空缓冲区，可能为NULL
+        time_t sec;                 // 同一秒内的日志复用格式化好的时间，不再调用localtime
+        char time_str[24];
+        thread_buffer *prev, *next; // 已写过日志的线程的链表
+        thread_buffer() : registered(false), cur(NULL), len(0), lines(0), spare(NULL), sec(-1), prev(NULL), next(NULL) {}
+        ~thread_buffer();
+    };
+    // 交给后台线程的缓冲区
+    struct full_buffer {
+        char *buf;
+        int len;
+        int lines;
+    };
+    static thread_buffer &local();
+    void buffer_append(const char *level, const struct timeval &now, const char *format, va_list valst);
+    // 交出tb.cur，调用时持有tb.lock
+    void submit(thread_buffer &tb);
+    // 线程退出时交出缓冲区并从链表中摘下
+    void retire(thread_buffer &tb);
+    // 取走所有线程中未写满的缓冲区，换上空缓冲区
+    void collect(vector<full_buffer> &full, vector<char *> &idle);
+    // 每个缓冲区一次write写入文件，写完的缓冲区放入idle
+    void write_buffers(vector<full_buffer> &full, vector<char *> &idle);
+    void *buffer_write_log();
+
 private:
     char dir_name[128]; // 路径名
     char log_name[128]; // log文件名
@@ -63,6 +114,18 @@ private:
     block_queue<string> *m_log_queue; // 阻塞队列
     bool m_is_async;                  // 是否同步标志位
     locker m_mutex;     // 互斥锁
+
+    bool m_is_buffered;               // 是否按线程双缓冲
+    int m_buffer_size;                // 每个线程缓冲区的大小
+    pthread_t m_buffer_tid;
+    bool m_stop;
+    locker m_list_lock;               // 保护m_threads链表，加锁顺序为m_list_lock、thread_buffer::lock、m_buffer_lock
+    thread_buffer *m_threads;
+    locker m_buffer_lock;             // 保护以下成员
+    cond m_buffer_cond;               // 有写满的缓冲区时唤醒后台线程
+    vector<full_buffer> m_full;       // 写满等待写入文件的缓冲区
+    vector<char *> m_idle;            // 已写入文件的空缓冲区，由写满缓冲区的线程取用
+    long long m_dropped;              // 丢弃的行数，后台线程写入一行警告后清零
 };
 
 // 这四个宏定义在其他文件中使用，主要用于不同类型的日志输出
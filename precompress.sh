@@ -0,0 +1,16 @@
+#!/bin/bash
+# 预压缩网站根目录下的文本文件，生成同名的.gz和.br文件，浏览器接受压缩时服务器直接发送压缩文件，不在请求时压缩
+# 只重新压缩比压缩文件新的文件，修改页面后重新运行即可；没有安装brotli命令时只生成.gz
+# 用法：./precompress.sh [网站根目录]，默认为./root
+root=${1:-./root}
+
+find "$root" -type f \( -name '*.html' -o -name '*.css' -o -name '*.js' -o -name '*.json' \
+    -o -name '*.svg' -o -name '*.txt' -o -name '*.xml' \) | while read -r f; do
+    # 压缩文件保留原文件的修改时间和权限，服务器据此判断压缩文件是否过期
+    if [ ! -e "$f.gz" ] || [ "$f" -nt "$f.gz" ]; then
+        gzip -9 -k -f -n "$f" && echo "$f.gz"
+    fi
+    if command -v brotli > /dev/null && { [ ! -e "$f.br" ] || [ "$f" -nt "$f.br" ]; }; then
+        brotli -q 11 -k -f "$f" && echo "$f.br"
+    fi
+done
@@ -0,0 +1,383 @@
+#include <cstdio>
+#include <cstring>
+#include <cassert>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include "event_loop.h"
+#include "../log/log.h"
+
+#define listenfdLT      // 监听文件描述符水平触发 （阻塞）
+// #define listenfdET    // 监听文件描述符边缘触发（非阻塞）
+
+#define LAZYTIMER       // 惰性刷新定时器，读写时只记录last_active，注释掉则每次读写都调整定时器
+
+// 以下三个函数在http_conn.cpp中定义了，这里显式声明一下
+extern int setnonblocking(int fd);
+extern void addfd(int epollfd, int fd, bool one_shot);
+extern void removefd(int epollfd, int fd);
+
+event_loop* event_loop::s_loops[MAX_LOOP_NUMBER];
+int event_loop::s_loop_count = 0;
+int event_loop::s_signalfd = -1;
+std::atomic<bool> event_loop::s_stop(false);
+
+static void show_error(int connfd, const char* info) {
+    printf("%s", info);
+    send(connfd, info, strlen(info), 0);
+    close(connfd);
+}
+
+event_loop::event_loop(int loop_id, http_conn *users, client_data *users_timer, threadpool<http_conn> *pool) :
+m_loop_id(loop_id), m_listenfd(-1), m_epollfd(-1), m_timerfd(-1), m_eventfd(-1), m_armed_expire(0), m_now(time(NULL)),
+#ifdef LAZYTIMER
+m_timer_wheel(3 * TIMESLOT),
+#endif
+m_timer_cb(cb_func), m_users(users), m_users_timer(users_timer), m_pool(pool), m_scratch(NULL), m_scratch_size(0) {}
+
+event_loop::~event_loop() {
+    // 收尾工作，关闭本事件循环建立的文件描述符
+    if (m_epollfd != -1) close(m_epollfd);
+    if (m_listenfd != -1) close(m_listenfd);
+    if (m_timerfd != -1) close(m_timerfd);
+    if (m_eventfd != -1) close(m_eventfd);
+    delete[] m_scratch;
+}
+
+bool event_loop::init(int port, bool reuseport) {
+    if (!create_listen(port, reuseport)) return false;
+
+    // 创建内核事件表，把监听文件描述符添加到内核事件中，注意监听文件描述符不需要注册EPOLLONESHOT事件
+    m_epollfd = epoll_create(5);
+    if (m_epollfd == -1) return false;
+    addfd(m_epollfd, m_listenfd, false);
+
+    if (!create_notify_fds()) return false;
+    addfd(m_epollfd, m_timerfd, false);
+    addfd(m_epollfd, m_eventfd, false);
+    if (m_loop_id == 0) addfd(m_epollfd, s_signalfd, false);
+
+    m_scratch_size = buffer_pool::GetInstance()->max_size();
+    m_scratch = new char[m_scratch_size];
+    return true;
+}
+
+bool event_loop::create_listen(int port, bool reuseport) {
+    // 创建监听文件描述符，采用TCP连接
+    m_listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (m_listenfd < 0) return false;
+
+    struct sockaddr_in address;
+    bzero(&address, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+
+    // 设置端口复用，多事件循环时每个循环各自bind同一端口，由内核把新连接分散到各个监听socket上
+    int flag = 1;
+    setsockopt(m_listenfd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+    if (reuseport && setsockopt(m_listenfd, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag)) < 0) return false;
+    if (bind(m_listenfd, (struct sockaddr *)&address, sizeof(address)) < 0) return false;
+    if (listen(m_listenfd, 5) < 0) return false;
+    return true;
+}
+
+bool event_loop::create_notify_fds() {
+    if (s_loop_count >= MAX_LOOP_NUMBER) return false;
+    // 定时器的超时时间是time(NULL)的绝对时间，故timerfd使用CLOCK_REALTIME并按绝对时间设置
+    m_timerfd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (m_timerfd == -1) return false;
+    m_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_eventfd == -1) return false;
+
+    // 登记本事件循环，收到SIGTERM时逐个唤醒
+    s_loops[s_loop_count++] = this;
+    return true;
+}
+
+void* event_loop::worker(void *arg) {
+    event_loop *ev_loop = (event_loop*) arg;
+    ev_loop->loop();
+    return ev_loop;
+}
+
+// 屏蔽SIGTERM并创建signalfd，信号不再打断任何线程的阻塞系统调用，而是作为普通的可读事件由0号事件循环处理
+bool event_loop::init_signalfd() {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0) return false;
+    s_signalfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    return s_signalfd != -1;
+}
+
+// 设置信号函数
+void event_loop::addsig(int sig, void (handler)(int), bool restart) {
+    // 创建sigaction结构体变量并初始化
+    struct sigaction sa;
+    memset(&sa, '\0', sizeof(sa));
+    // 信号处理函数中仅仅发送信号值，不做对应逻辑处理
+    sa.sa_handler = handler;
+    if (restart) sa.sa_flags |= SA_RESTART;
+    // 将所有信号添加到信号集中
+    sigfillset(&sa.sa_mask);
+    // 执行sigaction函数，assert函数是内部判别式为false时终止程序，即如果返回值为-1报错
+    assert(sigaction(sig, &sa, NULL) != -1);
+}
+
+// 定时器回调函数，删除非活动连接在socket上的注册事件，关闭文件描述符，减少用户连接数
+void event_loop::cb_func(client_data* user_data) {
+    assert(user_data);
+    epoll_ctl(user_data->epollfd, EPOLL_CTL_DEL, user_data->sockfd, 0);
+    close(user_data->sockfd);
+    --http_conn::m_user_count;
+    // 记录日志
+    LOG_INFO("close fd %d", user_data->sockfd);
+    Log::get_instance()->flush();
+}
+
+// 定时处理任务，timerfd到期时调用，此时已经不再处于设置状态
+void event_loop::timer_handler() {
+    m_armed_expire = 0;
+    m_timer_wheel.tick();
+}
+
+void event_loop::arm_timer() {
+    time_t expire = m_timer_wheel.next_expire();
+    if (expire == m_armed_expire) return;
+    m_armed_expire = expire;
+    // it_value为0时取消定时，否则在链表头部定时器的超时时刻到期
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = expire;
+    timerfd_settime(m_timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+void event_loop::add_timer(int connfd, const sockaddr_in &client_address) {
+    // 初始化client_data数据对应的连接资源，创建定时器临时变量，与用户数据绑定起来，最后把定时器添加到升序链表当中
+    m_users_timer[connfd].address = client_address;
+    m_users_timer[connfd].sockfd = connfd;
+    m_users_timer[connfd].epollfd = m_epollfd;
+    m_users_timer[connfd].last_active = m_now;
+    m_users_timer[connfd].pending = false;
+    util_timer *timer = new util_timer;
+    timer->user_data = &m_users_timer[connfd];
+    timer->cb_func = m_timer_cb;
+    // 超时时间设为当前时间+三倍TIMESLOT
+    timer->expire = m_now + 3 * TIMESLOT;
+    m_users_timer[connfd].timer = timer;
+    m_timer_wheel.add_timer(timer);
+}
+
+void event_loop::adjust_timer(util_timer *timer) {
+#ifdef LAZYTIMER
+    // 只记录活跃时间，定时器到期时由时间轮复查后再顺延
+    timer->user_data->last_active = m_now;
+#else
+    // 由于实现了数据传输，可以把相应的定时器向后移动3个TIMESLOT单位，调用adjust_timer函数
+    LOG_INFO("%s", "adjust timer once");
+    Log::get_instance()->flush();
+    timer->expire = m_now + 3 * TIMESLOT;
+    m_timer_wheel.adjust_timer(timer);
+#endif
+}
+
+void event_loop::deal_connection() {
+    struct sockaddr_in client_address;
+    socklen_t client_addr_len = sizeof(client_address);
+
+#ifdef listenfdLT
+    int connfd = accept(m_listenfd, (struct sockaddr* )&client_address, &client_addr_len);
+    if (connfd < 0) {
+        // 返回connfd出错，写入日志
+        LOG_ERROR("%s: errno is: %d", "accept error", errno);
+        return;
+    }
+    // 若连接数量已达上限，显示当前服务器繁忙
+    if (http_conn::m_user_count >= MAX_FD) {
+        show_error(connfd, "Internal Server Busy");
+        LOG_ERROR("%s", "Internal Server Busy");
+        return;
+    }
+    // 若正常获得连接fd，利用它初始化http对象
+    m_users[connfd].init(connfd, client_address, m_epollfd, this);
+    add_timer(connfd, client_address);
+#endif
+
+// 如果是边缘触发模式，每次需要把新到达的客户连接完全处理结束，在connfd < 0或连接达到上限时退出循环即可
+#ifdef listenfdET
+    while (true) {
+        int connfd = accept(m_listenfd, (struct sockaddr* )&client_address, &client_addr_len);
+        if (connfd < 0) {
+            LOG_ERROR("%s: errno is: %d", "accept error", errno);
+            break;
+        }
+        if (http_conn::m_user_count >= MAX_FD) {
+            show_error(connfd, "Internal Server Busy");
+            LOG_ERROR("%s", "Internal Server Busy");
+            break;
+        }
+        m_users[connfd].init(connfd, client_address, m_epollfd, this);
+        add_timer(connfd, client_address);
+    }
+#endif
+}
+
+void event_loop::deal_close(int sockfd) {
+    util_timer *timer = m_users_timer[sockfd].timer;
+    timer->cb_func(&m_users_timer[sockfd]);
+    if (timer) m_timer_wheel.del_timer(timer);
+}
+
+void event_loop::set_pending(http_conn *conn, bool pending) {
+    m_users_timer[conn->get_sockfd()].pending = pending;
+}
+
+void event_loop::complete(http_conn *conn, unsigned gen, const char *page) {
+    m_done_lock.lock();
+    m_done.push_back(completion{conn, gen, page});
+    m_done_lock.unlock();
+    eventfd_write(m_eventfd, 1);
+}
+
+void event_loop::deal_completions() {
+    m_done_lock.lock();
+    m_done_swap.swap(m_done);
+    m_done_lock.unlock();
+
+    for (size_t i = 0; i < m_done_swap.size(); ++i) {
+        http_conn *conn = m_done_swap[i].conn;
+        int sockfd = conn->get_sockfd();
+        // 等待期间定时器不会关闭连接，仍在这里核对代数，fd被新连接复用后才到达的结果直接丢弃
+        if (sockfd < 0 || sockfd >= MAX_FD || !conn->resume(m_done_swap[i].gen, m_done_swap[i].page)) continue;
+        m_users_timer[sockfd].pending = false;
+        // 与读到请求时一样交给工作线程，由process生成响应
+        if (!m_pool->append(conn, sockfd)) {
+            deal_close(sockfd);
+            continue;
+        }
+        util_timer *timer = m_users_timer[sockfd].timer;
+        if (timer) adjust_timer(timer);
+    }
+    m_done_swap.clear();
+}
+
+void event_loop::deal_signal() {
+    struct signalfd_siginfo info;
+    while (read(s_signalfd, &info, sizeof(info)) == sizeof(info)) {
+        handle_signal(info);
+    }
+}
+
+void event_loop::handle_signal(const struct signalfd_siginfo &info) {
+    if (info.ssi_signo != SIGTERM) return;
+    // 设置退出标志后唤醒所有事件循环，包括自己
+    s_stop = true;
+    for (int i = 0; i < s_loop_count; ++i) {
+        eventfd_write(s_loops[i]->m_eventfd, 1);
+    }
+}
+
+void event_loop::deal_read(int sockfd) {
+    util_timer *timer = m_users_timer[sockfd].timer;
+    // 处理客户连接上接收到的数据
+    if (m_users[sockfd].read_once(m_scratch, m_scratch_size)) {
+        // 写入日志时用到了新增的get_address函数，转换成了struct sockaddr_in地址
+        LOG_INFO("deal with the clients(%s)", inet_ntoa(m_users[sockfd].get_address()->sin_addr));
+        Log::get_instance()->flush();
+
+        // 如果一次性读取浏览器发来的全部数据成功，将该事件放入线程池请求队列中
+        // 请求队列已满时关闭连接，否则EPOLLONESHOT的连接不会再被触发，只能挂到超时
+        if (!m_pool->append(m_users + sockfd, sockfd)) {
+            deal_close(sockfd);
+            return;
+        }
+        if (timer) adjust_timer(timer);
+    } else {
+        // 如果读取数据失败，服务器端关闭连接，并移除对应的定时器
+        deal_close(sockfd);
+    }
+}
+
+void event_loop::deal_write(int sockfd) {
+    util_timer *timer = m_users_timer[sockfd].timer;
+    // 处理客户连接写入的数据
+    if (m_users[sockfd].write()) {
+        LOG_INFO("send data to the client(%s)", inet_ntoa(m_users[sockfd].get_address()->sin_addr));
+        Log::get_instance()->flush();
+        // 响应发送完毕而读缓冲区中还有流水线请求，write没有注册读事件，直接交给工作线程处理
+        if (m_users[sockfd].bytes_to_send() == 0 && m_users[sockfd].has_buffered_request() &&
+            !m_pool->append(m_users + sockfd, sockfd)) {
+            deal_close(sockfd);
+            return;
+        }
+        if (timer) adjust_timer(timer);
+    } else {
+        // 如果写入数据失败，服务器端关闭连接，并移除对应的定时器
+        deal_close(sockfd);
+    }
+}
+
+void event_loop::loop() {
+    bool stop_server = false;
+    // 超时默认false
+    bool timeout = false;
+
+    while (!stop_server) {
+        // 每轮循环开始前把timerfd设置为最早的超时时间
+        arm_timer();
+        // 调用epoll_wait函数，阻塞等待监控文件描述符是否有事件发生
+        int num = epoll_wait(m_epollfd, m_events, MAX_EVENT_NUMBER, -1);
+        if (num < 0 && errno != EINTR) {
+            // 如果返回变化数量为负且不是EINTR信号，出错，break，注意不是EAGAIN，导致出错
+            LOG_ERROR("%s", "epoll failure");
+            break;
+        }
+        // 本轮所有事件共用同一个当前时间，不必每次读写都调用time
+        m_now = time(NULL);
+        // 对所有就绪事件进行处理
+        for (int i = 0; i < num; ++i) {
+            int sockfd = m_events[i].data.fd;
+
+            // 如果文件描述符是监听fd，说明需要处理新到的客户连接
+            if (sockfd == m_listenfd) {
+                deal_connection();
+            }
+            // timerfd到期，读出到期次数以清除可读状态
+            else if (sockfd == m_timerfd) {
+                uint64_t expirations;
+                read(m_timerfd, &expirations, sizeof(expirations));
+                timeout = true;
+            }
+            // 被数据库线程或其他事件循环唤醒，处理完成的异步查询，检查是否需要退出
+            else if (sockfd == m_eventfd) {
+                eventfd_t val;
+                eventfd_read(m_eventfd, &val);
+                deal_completions();
+                if (stopping()) stop_server = true;
+            }
+            else if (sockfd == s_signalfd) {
+                deal_signal();
+            }
+            // 处理异常事件，即发生变化的内核事件包括EPOLLRDHUP | EPOLLHUP | EPOLLERR事件
+            else if (m_events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                deal_close(sockfd);
+            }
+            else if (m_events[i].events & EPOLLIN) {
+                deal_read(sockfd);
+            }
+            else if (m_events[i].events & EPOLLOUT) {
+                deal_write(sockfd);
+            }
+        }
+
+        // 在for循环遍历所有发生变化的文件描述符后，处理定时器超时事件，由于是非必要事件
+        // timerfd到期并不马上处理，而是在处理完所有读写事件后再进行处理
+        if (timeout) {
+            timer_handler();
+            timeout = false;
+        }
+    }
+}
@@ -0,0 +1,124 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <pthread.h>
+#include <atomic>
+#include <vector>
+#include "../http/http_conn.h"
+#include "../threadpool/threadpool.h"
+#include "../timer/time_wheel.h"
+
+#define MAX_FD 65536              // 最大文件描述符个数
+#define MAX_EVENT_NUMBER 10000    // 最大事件数
+#define TIMESLOT 5                // 最小超时单位 5s，连接空闲3个TIMESLOT后关闭
+#define MAX_LOOP_NUMBER 64        // 最多同时运行的事件循环个数
+
+// 事件循环类（one loop per thread），原来main函数中的epoll_wait主循环封装于此
+// 每个事件循环独占一个epoll内核事件表、一个监听socket、一个timerfd、一个eventfd和一个时间轮
+// timerfd总是设置为时间轮中最早可能到期的时间，到期后立即处理，不再依赖每TIMESLOT一次的SIGALRM
+// 信号统一屏蔽后通过signalfd由0号事件循环读取，收到SIGTERM后经各事件循环的eventfd通知它们一起退出
+// users和users_timer仍是按fd下标索引的全局数组，由于一个fd只会被一个事件循环accept，各个事件循环自然只访问属于自己的那一部分
+// 数据库线程完成的异步查询经complete放入本循环的完成列表，通过eventfd唤醒，由事件循环线程核对连接后交给线程池
+class event_loop : public conn_owner {
+public:
+    event_loop(int loop_id, http_conn *users, client_data *users_timer, threadpool<http_conn> *pool);
+    virtual ~event_loop();
+
+    // 创建监听socket、内核事件表、timerfd和eventfd，多事件循环模式下reuseport为true，各个监听socket绑定同一端口，由内核做负载均衡
+    virtual bool init(int port, bool reuseport);
+    // 事件循环主体，收到SIGTERM后返回
+    virtual void loop();
+    // 供pthread_create调用的线程函数，参数为event_loop指针
+    static void* worker(void *arg);
+
+    // 异步查询等待期间标记连接，定时器不关闭它
+    void set_pending(http_conn *conn, bool pending);
+    // 数据库线程调用，把完成的异步查询放入完成列表并唤醒事件循环
+    void complete(http_conn *conn, unsigned gen, const char *page);
+
+    // 设置信号函数
+    static void addsig(int sig, void (handler)(int), bool restart = true);
+    // 屏蔽SIGTERM并创建signalfd，必须在创建任何线程之前调用，使所有线程都继承该信号掩码
+    static bool init_signalfd();
+
+protected:
+    // 创建监听socket，init和其他I/O后端共用
+    bool create_listen(int port, bool reuseport);
+    // 创建timerfd和eventfd，并登记本事件循环，init和其他I/O后端共用
+    bool create_notify_fds();
+    // 处理从signalfd读到的信号，SIGTERM时通知所有事件循环退出
+    void handle_signal(const struct signalfd_siginfo &info);
+    // 所有事件循环是否应当退出
+    static bool stopping() {return s_stop;}
+
+    // 把timerfd设置为时间轮中最早的超时时间，与上次设置相同时不做系统调用
+    void arm_timer();
+    // 为新连接创建定时器并加入时间轮
+    void add_timer(int connfd, const sockaddr_in &client_address);
+    // 连接上有数据传输，将定时器向后延迟3个TIMESLOT，惰性刷新模式下只记录活跃时间
+    void adjust_timer(util_timer *timer);
+    // 服务器端关闭连接，并移除对应的定时器，其他I/O后端按自己的方式关闭
+    virtual void deal_close(int sockfd);
+    // 处理完成列表中的异步查询，在事件循环线程中调用
+    void deal_completions();
+    // timerfd到期，处理时间轮上超时的连接
+    void timer_handler();
+
+private:
+    // 处理监听socket上的新连接
+    void deal_connection();
+    // 读取signalfd中的信号
+    void deal_signal();
+    // 处理连接socket上的读事件
+    void deal_read(int sockfd);
+    // 处理连接socket上的写事件
+    void deal_write(int sockfd);
+
+    // 定时器回调函数，删除非活动连接在socket上的注册事件，关闭文件描述符，减少用户连接数
+    static void cb_func(client_data *user_data);
+
+protected:
+    int m_loop_id;                      // 事件循环编号，0号循环负责读取signalfd
+    int m_listenfd;                     // 本事件循环独占的监听socket
+    int m_epollfd;                      // 本事件循环独占的内核事件表，其他I/O后端为-1
+    int m_timerfd;                      // 设置为最早超时时间的定时器
+    int m_eventfd;                      // 唤醒本事件循环，退出时使用，其他I/O后端也用来接收工作线程的通知
+    time_t m_armed_expire;              // timerfd当前设置的超时时间，0表示未设置
+    time_t m_now;                       // 本轮事件处理开始时的时间，等待返回后更新一次
+    time_wheel m_timer_wheel;           // 本事件循环上所有连接的定时器
+    void (*m_timer_cb)(client_data*);   // 定时器超时回调，不同I/O后端关闭连接的方式不同
+    http_conn *m_users;
+    client_data *m_users_timer;
+    threadpool<http_conn> *m_pool;
+
+    static int s_signalfd;              // 所有线程共用的signalfd，只注册到0号事件循环
+
+    // 数据库线程交回的异步查询结果
+    struct completion {
+        http_conn *conn;
+        unsigned gen;
+        const char *page;
+    };
+    locker m_done_lock;                 // 保护m_done
+    std::vector<completion> m_done;
+    std::vector<completion> m_done_swap;
+
+private:
+    epoll_event m_events[MAX_EVENT_NUMBER];
+    // 临时读缓冲区，大小为连接缓冲区的上限；没有挂上读缓冲区的连接先读到这里，读到数据才取得自己的读缓冲区
+    // io_uring后端的缓冲环起同样的作用，不使用它
+    char *m_scratch;
+    int m_scratch_size;
+
+    // 所有已初始化的事件循环，收到SIGTERM时逐个唤醒
+    static event_loop* s_loops[MAX_LOOP_NUMBER];
+    static int s_loop_count;
+    static std::atomic<bool> s_stop;
+};
+
+#endif
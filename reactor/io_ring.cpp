@@ -0,0 +1,133 @@
+#include <cstring>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "io_ring.h"
+
+io_ring::io_ring() : m_ring_fd(-1), m_sq_ptr(MAP_FAILED), m_cq_ptr(MAP_FAILED), m_sq_size(0), m_cq_size(0),
+m_sqes((struct io_uring_sqe *)MAP_FAILED), m_sqes_size(0), m_sqe_tail(0), m_sqe_head(0),
+m_buf_ring(NULL), m_buf_entries(NULL), m_bufs(NULL), m_buf_count(0), m_buf_size(0), m_buf_tail(0) {}
+
+io_ring::~io_ring() {
+    if (m_buf_ring) munmap(m_buf_ring, m_buf_count * sizeof(struct io_uring_buf));
+    if (m_bufs) munmap(m_bufs, (size_t)m_buf_count * m_buf_size);
+    if (m_sqes != MAP_FAILED) munmap(m_sqes, m_sqes_size);
+    if (m_cq_ptr != MAP_FAILED && m_cq_ptr != m_sq_ptr) munmap(m_cq_ptr, m_cq_size);
+    if (m_sq_ptr != MAP_FAILED) munmap(m_sq_ptr, m_sq_size);
+    if (m_ring_fd != -1) close(m_ring_fd);
+}
+
+bool io_ring::init(unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    m_ring_fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (m_ring_fd < 0) return false;
+
+    // 提交队列环和完成队列环的大小由内核返回的偏移量决定
+    m_sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    m_cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (m_cq_size > m_sq_size) m_sq_size = m_cq_size;
+        m_cq_size = m_sq_size;
+    }
+    m_sq_ptr = mmap(0, m_sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQ_RING);
+    if (m_sq_ptr == MAP_FAILED) return false;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        m_cq_ptr = m_sq_ptr;
+    } else {
+        m_cq_ptr = mmap(0, m_cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_CQ_RING);
+        if (m_cq_ptr == MAP_FAILED) return false;
+    }
+    m_sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    m_sqes = (struct io_uring_sqe *)mmap(0, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQES);
+    if (m_sqes == MAP_FAILED) return false;
+
+    char *sq = (char *)m_sq_ptr;
+    m_sq_head = (unsigned *)(sq + p.sq_off.head);
+    m_sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    m_sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    m_sq_array = (unsigned *)(sq + p.sq_off.array);
+    m_sq_entries = p.sq_entries;
+    m_sqe_tail = m_sqe_head = *m_sq_tail;
+
+    char *cq = (char *)m_cq_ptr;
+    m_cq_head = (unsigned *)(cq + p.cq_off.head);
+    m_cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    m_cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    m_cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return true;
+}
+
+bool io_ring::setup_buf_ring(unsigned buf_count, unsigned buf_size, int bgid) {
+    m_buf_count = buf_count;
+    m_buf_size = buf_size;
+    // 缓冲环本身和缓冲区都需要页对齐，直接用匿名映射分配
+    void *ring = mmap(0, buf_count * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) return false;
+    m_buf_ring = (struct io_uring_buf_ring *)ring;
+    // 注意不能用m_buf_ring->bufs，头文件中的柔性数组宏在C++下会多出一个空结构体，bufs的偏移变成8而不是0
+    m_buf_entries = (struct io_uring_buf *)ring;
+    void *bufs = mmap(0, (size_t)buf_count * buf_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bufs == MAP_FAILED) return false;
+    m_bufs = (char *)bufs;
+
+    // 先把全部缓冲区放入缓冲环再注册
+    for (unsigned i = 0; i < buf_count; ++i) {
+        struct io_uring_buf *buf = &m_buf_entries[(m_buf_tail + i) & (buf_count - 1)];
+        buf->addr = (unsigned long)buf_addr(i);
+        buf->len = buf_size;
+        buf->bid = i;
+    }
+    m_buf_tail += buf_count;
+    __atomic_store_n(&m_buf_ring->tail, m_buf_tail, __ATOMIC_RELEASE);
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)m_buf_ring;
+    reg.ring_entries = buf_count;
+    reg.bgid = bgid;
+    if (syscall(__NR_io_uring_register, m_ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return false;
+    return true;
+}
+
+void io_ring::recycle_buf(int bid) {
+    struct io_uring_buf *buf = &m_buf_entries[m_buf_tail & (m_buf_count - 1)];
+    buf->addr = (unsigned long)buf_addr(bid);
+    buf->len = m_buf_size;
+    buf->bid = bid;
+    ++m_buf_tail;
+    __atomic_store_n(&m_buf_ring->tail, m_buf_tail, __ATOMIC_RELEASE);
+}
+
+struct io_uring_sqe* io_ring::get_sqe() {
+    unsigned head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+    if (m_sqe_tail - head >= m_sq_entries) {
+        // 提交队列已满，先把已有的提交给内核
+        submit_and_wait(0);
+        head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+        if (m_sqe_tail - head >= m_sq_entries) return NULL;
+    }
+    unsigned idx = m_sqe_tail & *m_sq_mask;
+    struct io_uring_sqe *sqe = &m_sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    m_sq_array[idx] = idx;
+    ++m_sqe_tail;
+    return sqe;
+}
+
+int io_ring::submit_and_wait(unsigned wait_nr) {
+    unsigned to_submit = m_sqe_tail - m_sqe_head;
+    // 写回提交队列尾，内核在io_uring_enter中消费
+    __atomic_store_n(m_sq_tail, m_sqe_tail, __ATOMIC_RELEASE);
+    m_sqe_head = m_sqe_tail;
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    return syscall(__NR_io_uring_enter, m_ring_fd, to_submit, wait_nr, flags, NULL, 0);
+}
+
+bool io_ring::peek_cqe(struct io_uring_cqe *cqe) {
+    unsigned head = *m_cq_head;
+    if (head == __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE)) return false;
+    *cqe = m_cqes[head & *m_cq_mask];
+    __atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
@@ -0,0 +1,61 @@
+#ifndef IO_RING_H
+#define IO_RING_H
+
+#include <cstddef>
+#include <linux/io_uring.h>
+
+// 对io_uring系统调用的最小封装，只用到事件循环需要的部分：提交队列、完成队列和提供缓冲区的缓冲环
+// 直接使用io_uring_setup/io_uring_enter/io_uring_register三个系统调用，不依赖liburing
+class io_ring {
+public:
+    io_ring();
+    ~io_ring();
+
+    // 创建io_uring实例并映射提交队列和完成队列，entries为提交队列长度
+    bool init(unsigned entries);
+    // 注册提供缓冲区的缓冲环，共buf_count个大小为buf_size的缓冲区，buf_count必须是2的幂
+    bool setup_buf_ring(unsigned buf_count, unsigned buf_size, int bgid);
+
+    // 获取一个空闲的提交队列项，已填零，提交队列满时先提交一次
+    struct io_uring_sqe* get_sqe();
+    // 提交所有新增的提交队列项，并至少等待wait_nr个完成事件，返回io_uring_enter的返回值
+    int submit_and_wait(unsigned wait_nr);
+    // 取出一个完成事件，没有则返回false
+    bool peek_cqe(struct io_uring_cqe *cqe);
+
+    // 缓冲区编号bid对应的地址
+    char* buf_addr(int bid) {return m_bufs + (size_t)bid * m_buf_size;}
+    // 数据拷贝走后把缓冲区归还给缓冲环
+    void recycle_buf(int bid);
+
+private:
+    int m_ring_fd;
+    void *m_sq_ptr;                 // 提交队列环的映射区
+    void *m_cq_ptr;                 // 完成队列环的映射区，支持IORING_FEAT_SINGLE_MMAP时与m_sq_ptr相同
+    size_t m_sq_size;
+    size_t m_cq_size;
+    struct io_uring_sqe *m_sqes;    // 提交队列项数组
+    size_t m_sqes_size;
+
+    unsigned *m_sq_head;
+    unsigned *m_sq_tail;
+    unsigned *m_sq_mask;
+    unsigned *m_sq_array;
+    unsigned m_sq_entries;
+    unsigned m_sqe_tail;            // 本地维护的提交队列尾，submit时才写回内核可见的m_sq_tail
+    unsigned m_sqe_head;            // 上一次提交后的队尾位置，二者之差即待提交数量
+
+    unsigned *m_cq_head;
+    unsigned *m_cq_tail;
+    unsigned *m_cq_mask;
+    struct io_uring_cqe *m_cqes;
+
+    struct io_uring_buf_ring *m_buf_ring;   // 缓冲环，内核从这里取空闲缓冲区，只用来访问与首项重叠的tail
+    struct io_uring_buf *m_buf_entries;     // 缓冲环的各项
+    char *m_bufs;                           // 所有缓冲区的连续内存
+    unsigned m_buf_count;
+    unsigned m_buf_size;
+    unsigned short m_buf_tail;
+};
+
+#endif
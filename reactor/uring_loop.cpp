@@ -0,0 +1,380 @@
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include "uring_loop.h"
+#include "../log/log.h"
+
+#define URING_ENTRIES 4096          // 提交队列长度
+#define BUF_GROUP_ID 0              // 缓冲环的组号
+#define BUF_COUNT 1024              // 缓冲环中缓冲区个数，必须是2的幂
+#define SQE_RETRY 16                // 取不到提交队列项时提交重试的次数
+
+uring_loop::uring_loop(int loop_id, http_conn *users, client_data *users_timer, threadpool<http_conn> *pool) :
+event_loop(loop_id, users, users_timer, pool), m_notify_val(0), m_timer_val(0), m_conns(NULL), m_rearm(0), m_buf_recycled(false), m_notified(false) {
+    m_timer_cb = cb_func;
+}
+
+uring_loop::~uring_loop() {
+    delete[] m_conns;
+}
+
+bool uring_loop::init(int port, bool reuseport) {
+    if (!create_listen(port, reuseport)) return false;
+    if (!create_notify_fds()) return false;
+
+    // 缓冲区大小与m_read_buf的初始大小相同，放不下时read_buffer会增长读缓冲区
+    if (!m_ring.init(URING_ENTRIES)) return false;
+    if (!m_ring.setup_buf_ring(BUF_COUNT, http_conn::READ_BUFFER_SIZE, BUF_GROUP_ID)) return false;
+
+    m_conns = new conn_state[MAX_FD];
+    memset(m_conns, 0, sizeof(conn_state) * MAX_FD);
+    return true;
+}
+
+unsigned long long uring_loop::encode(int type, int fd, unsigned gen) {
+    return ((unsigned long long)type << 56) | ((unsigned long long)(gen & 0xffffff) << 32) | (unsigned)fd;
+}
+
+struct io_uring_sqe* uring_loop::get_sqe() {
+    // io_ring::get_sqe在队列满时已经提交过一次，仍取不到说明内核暂时没有消费（如内存不足），稍后再提交重试
+    for (int i = 0; i < SQE_RETRY; ++i) {
+        struct io_uring_sqe *sqe = m_ring.get_sqe();
+        if (sqe) return sqe;
+        sched_yield();
+        m_ring.submit_and_wait(0);
+    }
+    LOG_ERROR("%s", "io_uring submission queue is full");
+    return NULL;
+}
+
+void uring_loop::prep_accept() {
+    struct io_uring_sqe *sqe = get_sqe();
+    if (!sqe) {
+        m_rearm |= 1 << OP_ACCEPT;
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = m_listenfd;
+    // multishot accept，一次提交持续产生新连接，直到完成事件中没有IORING_CQE_F_MORE标志
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = encode(OP_ACCEPT, m_listenfd, 0);
+}
+
+bool uring_loop::prep_recv(int fd) {
+    struct io_uring_sqe *sqe = get_sqe();
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    // 不指定缓冲区，由内核在数据到达时从缓冲环中选取，空闲连接不占用读缓冲区
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUF_GROUP_ID;
+    sqe->len = http_conn::READ_BUFFER_SIZE;
+    sqe->user_data = encode(OP_RECV, fd, m_conns[fd].gen);
+    m_conns[fd].recv_pending = true;
+    return true;
+}
+
+bool uring_loop::prep_write(int fd, bool link) {
+    int iv_count = 0;
+    struct iovec *iv = m_users[fd].get_iovec(iv_count);
+    struct io_uring_sqe *sqe = get_sqe();
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)iv;
+    sqe->len = iv_count;
+    sqe->user_data = encode(OP_WRITE, fd, m_conns[fd].gen);
+    // 长连接在响应报文后直接链接下一次recv，发送不完整时链会被内核取消，recv返回-ECANCELED
+    // 读缓冲区中还有流水线请求时不链接，发送完后先处理这些请求
+    if (link && m_users[fd].is_linger() && !m_users[fd].has_buffered_request() && !m_conns[fd].recv_pending) {
+        sqe->flags |= IOSQE_IO_LINK;
+        // 取不到recv的提交队列项时去掉链接，writev完成后on_write会补交recv
+        if (!prep_recv(fd)) sqe->flags &= ~IOSQE_IO_LINK;
+    }
+    return true;
+}
+
+void uring_loop::prep_signal() {
+    struct io_uring_sqe *sqe = get_sqe();
+    if (!sqe) {
+        m_rearm |= 1 << OP_SIGNAL;
+        return;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = s_signalfd;
+    sqe->addr = (unsigned long)&m_siginfo;
+    sqe->len = sizeof(m_siginfo);
+    sqe->user_data = encode(OP_SIGNAL, s_signalfd, 0);
+}
+
+void uring_loop::prep_timer() {
+    struct io_uring_sqe *sqe = get_sqe();
+    if (!sqe) {
+        m_rearm |= 1 << OP_TIMER;
+        return;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = m_timerfd;
+    sqe->addr = (unsigned long)&m_timer_val;
+    sqe->len = sizeof(m_timer_val);
+    sqe->user_data = encode(OP_TIMER, m_timerfd, 0);
+}
+
+void uring_loop::prep_notify() {
+    struct io_uring_sqe *sqe = get_sqe();
+    if (!sqe) {
+        m_rearm |= 1 << OP_NOTIFY;
+        return;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = m_eventfd;
+    sqe->addr = (unsigned long)&m_notify_val;
+    sqe->len = sizeof(m_notify_val);
+    sqe->user_data = encode(OP_NOTIFY, m_eventfd, 0);
+}
+
+void uring_loop::prep_close(int fd) {
+    struct io_uring_sqe *sqe = get_sqe();
+    if (!sqe) {
+        close(fd);
+        return;
+    }
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    sqe->user_data = encode(OP_CLOSE, fd, 0);
+}
+
+void uring_loop::rearm() {
+    unsigned rearm = m_rearm;
+    m_rearm = 0;
+    if (rearm & (1 << OP_ACCEPT)) prep_accept();
+    if (rearm & (1 << OP_SIGNAL)) prep_signal();
+    if (rearm & (1 << OP_TIMER)) prep_timer();
+    if (rearm & (1 << OP_NOTIFY)) prep_notify();
+}
+
+void uring_loop::drain_nobuf() {
+    m_buf_recycled = false;
+    std::vector<std::pair<int, unsigned> > parked;
+    parked.swap(m_nobuf);
+    for (size_t i = 0; i < parked.size(); ++i) {
+        int fd = parked[i].first;
+        // 挂起期间连接可能已经关闭，fd也可能被新连接复用
+        if (!m_conns[fd].open || m_conns[fd].gen != parked[i].second) continue;
+        m_conns[fd].recv_pending = false;
+        if (!prep_recv(fd)) close_conn(fd);
+    }
+}
+
+// 工作线程调用，只做入队，真正的读写请求由事件循环线程提交
+void uring_loop::notify(http_conn *conn, int ev) {
+    m_pending_lock.lock();
+    m_pending.push_back(std::make_pair(conn, ev));
+    bool wake = !m_notified;
+    m_notified = true;
+    m_pending_lock.unlock();
+    if (wake) eventfd_write(m_eventfd, 1);
+}
+
+void uring_loop::cb_func(client_data *user_data) {
+    // 关闭读写两端，该连接上未完成的recv/writev会立即返回，由事件循环走正常的关闭流程
+    shutdown(user_data->sockfd, SHUT_RDWR);
+    // tick中会释放该定时器，置空避免关闭连接时重复释放
+    user_data->timer = NULL;
+    LOG_INFO("shutdown fd %d", user_data->sockfd);
+    Log::get_instance()->flush();
+}
+
+void uring_loop::close_conn(int fd) {
+    util_timer *timer = m_users_timer[fd].timer;
+    if (timer) m_timer_wheel.del_timer(timer);
+    m_users_timer[fd].timer = NULL;
+    m_conns[fd].open = false;
+    m_conns[fd].recv_pending = false;
+    ++m_conns[fd].gen;
+    --http_conn::m_user_count;
+    prep_close(fd);
+    LOG_INFO("close fd %d", fd);
+    Log::get_instance()->flush();
+}
+
+void uring_loop::on_accept(const struct io_uring_cqe &cqe) {
+    // 没有IORING_CQE_F_MORE标志说明multishot accept已经终止，需要重新提交
+    if (!(cqe.flags & IORING_CQE_F_MORE)) prep_accept();
+    int connfd = cqe.res;
+    if (connfd < 0) {
+        LOG_ERROR("%s: errno is: %d", "accept error", -connfd);
+        return;
+    }
+    if (connfd >= MAX_FD || http_conn::m_user_count >= MAX_FD) {
+        const char *info = "Internal Server Busy";
+        send(connfd, info, strlen(info), 0);
+        close(connfd);
+        LOG_ERROR("%s", "Internal Server Busy");
+        return;
+    }
+    // multishot accept不返回对端地址，只在建立连接时查询一次，用于日志输出
+    struct sockaddr_in client_address;
+    socklen_t client_addr_len = sizeof(client_address);
+    memset(&client_address, 0, sizeof(client_address));
+    getpeername(connfd, (struct sockaddr *)&client_address, &client_addr_len);
+
+    m_users[connfd].init(connfd, client_address, m_epollfd, this, this);
+    add_timer(connfd, client_address);
+    m_conns[connfd].open = true;
+    m_conns[connfd].recv_pending = false;
+    if (!prep_recv(connfd)) close_conn(connfd);
+}
+
+void uring_loop::on_recv(int fd, const struct io_uring_cqe &cqe) {
+    m_conns[fd].recv_pending = false;
+    // 缓冲环已空，立即重新提交只会再次失败，挂起到其他连接归还缓冲区后再提交；挂起期间仍视为有未完成的recv
+    if (cqe.res == -ENOBUFS) {
+        m_conns[fd].recv_pending = true;
+        m_nobuf.push_back(std::make_pair(fd, m_conns[fd].gen));
+        return;
+    }
+    // 被链中前面发送不完整的writev取消，writev全部完成后会重新提交recv
+    if (cqe.res == -ECANCELED) return;
+
+    int bid = (cqe.flags & IORING_CQE_F_BUFFER) ? (cqe.flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+    bool ok = cqe.res > 0 && bid >= 0 && m_users[fd].read_buffer(m_ring.buf_addr(bid), cqe.res);
+    if (bid >= 0) {
+        m_ring.recycle_buf(bid);
+        m_buf_recycled = true;
+    }
+    if (!ok) {
+        // 对端关闭、出错或读缓冲区已满，服务器端关闭连接，并移除对应的定时器
+        close_conn(fd);
+        return;
+    }
+
+    LOG_INFO("deal with the clients(%s)", inet_ntoa(m_users[fd].get_address()->sin_addr));
+    Log::get_instance()->flush();
+    if (!m_pool->append(m_users + fd, fd)) {
+        close_conn(fd);
+        return;
+    }
+    util_timer *timer = m_users_timer[fd].timer;
+    if (timer) adjust_timer(timer);
+}
+
+void uring_loop::on_write(int fd, const struct io_uring_cqe &cqe) {
+    if (cqe.res < 0 || !m_users[fd].write_done(cqe.res)) {
+        // 发送失败或短连接发送完毕，关闭连接；链接的recv会被取消，其完成事件因代数不同而被丢弃
+        close_conn(fd);
+        return;
+    }
+    // 与epoll后端的deal_write一样，每次发送都算作连接活跃，慢速客户端接收大文件时不会在发送途中被当作空闲连接关闭
+    util_timer *timer = m_users_timer[fd].timer;
+    if (timer) adjust_timer(timer);
+    // 还有数据没发完，继续提交writev
+    if (m_users[fd].bytes_to_send() > 0) {
+        if (!prep_write(fd, false)) close_conn(fd);
+        return;
+    }
+
+    LOG_INFO("send data to the client(%s)", inet_ntoa(m_users[fd].get_address()->sin_addr));
+    Log::get_instance()->flush();
+    // 读缓冲区中还有流水线请求时直接交给工作线程，处理完再通知读写
+    if (m_users[fd].has_buffered_request()) {
+        if (!m_pool->append(m_users + fd, fd)) close_conn(fd);
+        return;
+    }
+    // 链接的recv被取消时在这里补交
+    if (!m_conns[fd].recv_pending && !prep_recv(fd)) close_conn(fd);
+}
+
+void uring_loop::on_notify() {
+    m_pending_lock.lock();
+    m_pending_swap.swap(m_pending);
+    m_notified = false;
+    m_pending_lock.unlock();
+
+    for (size_t i = 0; i < m_pending_swap.size(); ++i) {
+        int fd = m_pending_swap[i].first->get_sockfd();
+        int ev = m_pending_swap[i].second;
+        // 工作线程处理期间连接可能已经关闭
+        if (fd < 0 || fd >= MAX_FD || !m_conns[fd].open) continue;
+        bool ok = false;
+        if (ev == EPOLLIN) ok = prep_recv(fd);
+        else if (ev == EPOLLOUT) ok = prep_write(fd, true);
+        if (!ok) close_conn(fd);
+    }
+    m_pending_swap.clear();
+    // 数据库线程交回的异步查询结果也通过同一个eventfd唤醒
+    deal_completions();
+    prep_notify();
+}
+
+void uring_loop::loop() {
+    bool stop_server = false;
+    bool timeout = false;
+
+    prep_accept();
+    if (m_loop_id == 0) prep_signal();
+    prep_timer();
+    prep_notify();
+
+    while (!stop_server) {
+        arm_timer();
+        // 一次io_uring_enter既提交上一轮产生的所有请求，又等待新的完成事件
+        int ret = m_ring.submit_and_wait(1);
+        if (ret < 0 && errno != EINTR) {
+            LOG_ERROR("%s", "io_uring failure");
+            break;
+        }
+        m_now = time(NULL);
+
+        struct io_uring_cqe cqe;
+        while (m_ring.peek_cqe(&cqe)) {
+            int type = cqe.user_data >> 56;
+            unsigned gen = (cqe.user_data >> 32) & 0xffffff;
+            int fd = (int)(cqe.user_data & 0xffffffff);
+
+            switch (type) {
+            case OP_ACCEPT:
+                on_accept(cqe);
+                break;
+            case OP_SIGNAL:
+                if (cqe.res == sizeof(m_siginfo)) handle_signal(m_siginfo);
+                prep_signal();
+                break;
+            case OP_TIMER:
+                timeout = true;
+                prep_timer();
+                break;
+            case OP_NOTIFY:
+                // 工作线程的通知和退出通知共用同一个eventfd
+                on_notify();
+                if (stopping()) stop_server = true;
+                break;
+            case OP_RECV:
+            case OP_WRITE:
+                // fd已关闭或被新连接复用，丢弃旧的完成事件，但选中的缓冲区必须归还
+                if (!m_conns[fd].open || (m_conns[fd].gen & 0xffffff) != gen) {
+                    if (cqe.flags & IORING_CQE_F_BUFFER) {
+                        m_ring.recycle_buf(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                        m_buf_recycled = true;
+                    }
+                    break;
+                }
+                if (type == OP_RECV) on_recv(fd, cqe);
+                else on_write(fd, cqe);
+                break;
+            default:
+                break;
+            }
+        }
+        if (!m_nobuf.empty() && m_buf_recycled) drain_nobuf();
+        if (m_rearm) rearm();
+
+        if (timeout) {
+            timer_handler();
+            timeout = false;
+        }
+    }
+}
@@ -0,0 +1,84 @@
+#ifndef URING_LOOP_H
+#define URING_LOOP_H
+
+#include <vector>
+#include <utility>
+#include "event_loop.h"
+#include "io_ring.h"
+#include "../lock/locker.h"
+
+// 基于io_uring的事件循环，与event_loop共用监听socket、signalfd、timerfd和时间轮，只替换I/O部分：
+// 监听socket上提交一个multishot accept，连接上的recv从缓冲环中选取缓冲区，响应报文用writev发送，
+// 长连接的writev和下一次recv通过IOSQE_IO_LINK链接在一起提交，工作线程通过eventfd通知事件循环，timerfd和signalfd也以读请求的方式提交
+// 每个连接任一时刻只有一个未完成的读写请求（相当于EPOLLONESHOT），关闭连接统一由事件循环完成
+class uring_loop : public event_loop, public io_notifier {
+public:
+    uring_loop(int loop_id, http_conn *users, client_data *users_timer, threadpool<http_conn> *pool);
+    ~uring_loop();
+
+    bool init(int port, bool reuseport);
+    void loop();
+    // 工作线程处理完请求后调用，把连接放入待处理列表并唤醒事件循环
+    void notify(http_conn *conn, int ev);
+
+protected:
+    // 异步查询交回后线程池已满时关闭连接
+    void deal_close(int sockfd) {close_conn(sockfd);}
+
+private:
+    // 提交队列项的类型，与fd和连接代数一起编码进user_data
+    enum OP_TYPE {OP_ACCEPT = 1, OP_RECV, OP_WRITE, OP_SIGNAL, OP_TIMER, OP_NOTIFY, OP_CLOSE};
+
+    // 每个fd在本事件循环中的状态，gen在关闭时递增，用来丢弃fd被复用后才到达的旧完成事件
+    struct conn_state {
+        unsigned gen;
+        bool open;
+        bool recv_pending;
+    };
+
+    static unsigned long long encode(int type, int fd, unsigned gen);
+
+    // 取得一个提交队列项，提交后仍没有空位时让出CPU再提交重试，多次失败返回NULL
+    struct io_uring_sqe* get_sqe();
+    // 监听socket、signalfd、timerfd和eventfd上的请求取不到提交队列项时记入m_rearm，本轮完成事件处理完后重新提交
+    void prep_accept();
+    void prep_signal();
+    void prep_timer();
+    void prep_notify();
+    void rearm();
+    // 连接上的请求取不到提交队列项时返回false，由调用者关闭连接
+    bool prep_recv(int fd);
+    // link为true且是长连接时，在writev后链接一个recv
+    bool prep_write(int fd, bool link);
+    // 取不到提交队列项时直接同步close
+    void prep_close(int fd);
+    // 缓冲环暂时为空时recv返回-ENOBUFS，连接先挂起，本轮有缓冲区归还后再重新提交recv
+    void drain_nobuf();
+
+    void on_accept(const struct io_uring_cqe &cqe);
+    void on_recv(int fd, const struct io_uring_cqe &cqe);
+    void on_write(int fd, const struct io_uring_cqe &cqe);
+    void on_notify();
+    // 移除定时器并提交close，连接上不能再有未完成的读写请求
+    void close_conn(int fd);
+
+    // 定时器回调函数，只shutdown连接，未完成的recv随之返回0，再由事件循环统一关闭
+    static void cb_func(client_data *user_data);
+
+private:
+    io_ring m_ring;
+    unsigned long long m_notify_val;    // eventfd的读缓冲区，工作线程通过基类的m_eventfd唤醒事件循环
+    unsigned long long m_timer_val;     // timerfd的读缓冲区
+    struct signalfd_siginfo m_siginfo;  // signalfd的读缓冲区
+    conn_state *m_conns;
+    unsigned m_rearm;                   // 需要重新提交的固定请求，按OP_TYPE置位
+    bool m_buf_recycled;                // 本轮处理完成事件时是否有缓冲区归还给缓冲环
+    std::vector<std::pair<int, unsigned> > m_nobuf;     // 因-ENOBUFS挂起的连接及其代数
+
+    locker m_pending_lock;              // 保护工作线程提交的待处理列表
+    std::vector<std::pair<http_conn*, int> > m_pending;
+    std::vector<std::pair<http_conn*, int> > m_pending_swap;
+    bool m_notified;                    // 已写eventfd但事件循环还没处理，避免重复写
+};
+
+#endif
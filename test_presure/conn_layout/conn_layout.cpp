@@ -0,0 +1,264 @@
+// http_conn内存布局对比测试：改动前按声明顺序排列、不对齐的布局 vs 按访问顺序排列、按缓存行对齐并拆出冷字段的布局
+// 两个结构体的字段与对应版本的http_conn相同，handle按一个请求从读取、解析、生成响应到发送完的顺序读写这些字段
+// 只访问连接对象本身，不访问缓冲区和文件，测出的差别只来自布局
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <atomic>
+#include <x86intrin.h>
+
+// 改动前（拆分冷热字段之前）的http_conn，264字节，按8字节对齐，相邻的连接共用首尾的缓存行
+struct conn_before {
+    void *m_mysql;
+    int m_epollfd;
+    void *m_notifier;
+    int m_sockfd;
+    sockaddr_in m_address;
+    char *m_read_buf;
+    int m_read_size;
+    int m_read_idx;
+    int m_checked_idx;
+    int m_start_line;
+    char *m_write_buf;
+    int m_write_size;
+    int m_write_idx;
+    int m_check_state;
+    int m_method;
+    void *m_req;
+    char *m_real_file;
+    char *m_url;
+    char *m_version;
+    int m_content_length;
+    bool m_linger;
+    bool m_keep_alive;
+    char *m_file_address;
+    void *m_cache_file;
+    void *m_compressed_file;
+    int m_file_fd;
+    int m_queued_count;
+    const char *m_content_encoding;
+    void *m_resp;
+    void *m_file_stat;
+    void *m_ranges;
+    void *m_queued;
+    void *m_iv;
+    int m_iv_count;
+    int m_iv_idx;
+    int m_iv_base;
+    int m_resp_start;
+    int m_cgi;
+    char *m_user_data;
+    int m_bytes_to_send;
+    int m_bytes_have_sent;
+    std::atomic<unsigned> m_gen;
+};
+
+// 现在的http_conn，256字节，按缓存行对齐；m_cgi和m_user_data移入request_state，地址、数据库连接和代数移入m_cold
+struct alignas(64) conn_after {
+    int m_sockfd;
+    int m_epollfd;
+    void *m_notifier;
+    char *m_read_buf;
+    int m_read_size;
+    int m_read_idx;
+    int m_checked_idx;
+    int m_start_line;
+    int m_check_state;
+    int m_method;
+    void *m_req;
+    char *m_real_file;
+    char *m_url;
+    char *m_version;
+    int m_content_length;
+    bool m_linger;
+    bool m_keep_alive;
+    char *m_write_buf;
+    int m_write_size;
+    int m_write_idx;
+    char *m_file_address;
+    void *m_cache_file;
+    void *m_compressed_file;
+    int m_file_fd;
+    int m_queued_count;
+    void *m_resp;
+    void *m_iv;
+    int m_iv_count;
+    int m_iv_idx;
+    int m_iv_base;
+    int m_resp_start;
+    int m_bytes_to_send;
+    int m_bytes_have_sent;
+    void *m_file_stat;
+    void *m_ranges;
+    void *m_queued;
+    const char *m_content_encoding;
+    void *m_cold;
+};
+
+static char dummy[4096];
+
+// 一个请求访问连接对象的顺序：事件循环read_once，工作线程process_read、do_request、process_write、end_request、rearm，事件循环write
+template <class C>
+static inline unsigned handle(C &c, int n) {
+    unsigned sum = 0;
+    // read_once
+    sum += c.m_sockfd;
+    if (!c.m_read_buf) {
+        c.m_read_buf = dummy;
+        c.m_read_size = 2048;
+        c.m_req = dummy;
+        c.m_real_file = dummy;
+    }
+    c.m_read_idx += n;
+    // process和process_read
+    if (!c.m_resp) {
+        c.m_resp = dummy;
+        c.m_iv = dummy;
+        c.m_ranges = dummy;
+        c.m_queued = dummy;
+        c.m_file_stat = dummy;
+    }
+    c.m_check_state = 0;
+    c.m_method = 0;
+    c.m_url = c.m_read_buf + 4;
+    c.m_version = c.m_read_buf + 20;
+    c.m_check_state = 1;
+    c.m_start_line = c.m_checked_idx;
+    c.m_checked_idx = c.m_read_idx;
+    c.m_linger = true;
+    c.m_content_length = 0;
+    // do_request和map_file
+    sum += (unsigned long)c.m_real_file;
+    c.m_file_address = dummy;
+    c.m_cache_file = dummy;
+    c.m_compressed_file = NULL;
+    c.m_file_fd = -1;
+    c.m_content_encoding = NULL;
+    sum += (unsigned long)c.m_file_stat;
+    // process_write
+    if (!c.m_write_buf) {
+        c.m_write_buf = dummy;
+        c.m_write_size = 1024;
+    }
+    c.m_write_idx = 160;
+    sum += (unsigned long)c.m_ranges + (unsigned long)c.m_iv;
+    c.m_iv_count = c.m_iv_base + 2;
+    c.m_bytes_to_send = c.m_write_idx - c.m_resp_start + 4096;
+    // end_request和queue_response
+    c.m_keep_alive = c.m_linger;
+    c.m_read_idx -= c.m_checked_idx;
+    c.m_checked_idx = 0;
+    c.m_start_line = 0;
+    c.m_url = NULL;
+    c.m_version = NULL;
+    sum += c.m_queued_count + (unsigned long)c.m_queued;
+    // rearm
+    sum += (unsigned long)c.m_notifier + c.m_epollfd;
+    // write和init_response
+    sum += c.m_file_fd + c.m_iv_idx;
+    c.m_bytes_have_sent += c.m_bytes_to_send;
+    c.m_bytes_to_send = 0;
+    c.m_write_idx = 0;
+    c.m_resp_start = 0;
+    c.m_iv_idx = 0;
+    c.m_iv_base = 0;
+    c.m_iv_count = 0;
+    c.m_write_buf = NULL;
+    c.m_resp = NULL;
+    sum += c.m_keep_alive;
+    return sum;
+}
+
+static const int MAX_THREADS = 8;
+
+template <class C>
+struct job {
+    C *conns;
+    const int *order;
+    int count;
+    long requests;
+    int thread;
+    int threads;
+    unsigned sum;
+};
+
+// order为要处理的连接下标，多线程时第t个线程处理order[t], order[t + threads] ...
+template <class C>
+static void* run(void *arg) {
+    job<C> *j = (job<C> *)arg;
+    unsigned sum = 0;
+    long done = 0;
+    while (done < j->requests) {
+        for (int i = j->thread; i < j->count && done < j->requests; i += j->threads, ++done) {
+            sum += handle(j->conns[j->order[i]], 500);
+        }
+    }
+    j->sum = sum;
+    return NULL;
+}
+
+// 返回平均每个请求的周期数
+template <class C>
+static double measure(int count, const int *order, long requests, int threads) {
+    C *conns = new C[count];
+    memset((void *)conns, 0, sizeof(C) * count);
+    job<C> jobs[MAX_THREADS];
+    pthread_t tids[MAX_THREADS];
+    for (int t = 0; t < threads; ++t) jobs[t] = job<C>{conns, order, count, requests / threads, t, threads, 0};
+    // 先跑一遍预热，让连接对象都在内存中
+    job<C> warm = {conns, order, count, count, 0, 1, 0};
+    run<C>(&warm);
+
+    unsigned long long start = __rdtsc();
+    for (int t = 0; t < threads; ++t) pthread_create(&tids[t], NULL, run<C>, &jobs[t]);
+    for (int t = 0; t < threads; ++t) pthread_join(tids[t], NULL);
+    unsigned long long cycles = __rdtsc() - start;
+    delete[] conns;
+    // 多线程时按每个线程的周期数计算，即单个请求的延迟
+    return (double)cycles / (requests / threads);
+}
+
+// 参数为伪共享测试的线程数，默认为CPU数（最多8个）
+int main(int argc, char *argv[]) {
+    int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    printf("sizeof: before %zu bytes, after %zu bytes (align %zu), %d CPUs\n", sizeof(conn_before), sizeof(conn_after), alignof(conn_after), cpus);
+
+    // 随机顺序访问不同数量的连接：512个在L1/L2中，65536个（MAX_FD）超过L2
+    const int counts[] = {512, 8192, 65536};
+    const long requests = 20000000;
+    for (int k = 0; k < 3; ++k) {
+        int count = counts[k];
+        int *order = new int[count];
+        for (int i = 0; i < count; ++i) order[i] = i;
+        srand(1);
+        for (int i = count - 1; i > 0; --i) {
+            int r = rand() % (i + 1);
+            int tmp = order[i];
+            order[i] = order[r];
+            order[r] = tmp;
+        }
+        double before = measure<conn_before>(count, order, requests, 1);
+        double after = measure<conn_after>(count, order, requests, 1);
+        printf("%6d connections, random order:   before %6.1f cycles/request  after %6.1f cycles/request\n", count, before, after);
+        delete[] order;
+    }
+
+    // 相邻的连接由不同线程处理，改动前相邻对象共用缓存行，会发生伪共享
+    int threads = argc > 1 ? atoi(argv[1]) : (cpus < MAX_THREADS ? cpus : MAX_THREADS);
+    if (threads < 2 || threads > MAX_THREADS) {
+        printf("adjacent connections on different threads: skipped, needs 2 to %d threads\n", MAX_THREADS);
+        return 0;
+    }
+    const int count = 64;
+    int order[count];
+    for (int i = 0; i < count; ++i) order[i] = i;
+    double before = measure<conn_before>(count, order, requests, threads);
+    double after = measure<conn_after>(count, order, requests, threads);
+    printf("%d threads on adjacent connections:  before %6.1f cycles/request  after %6.1f cycles/request%s\n", threads, before, after,
+           threads > cpus ? "  (more threads than CPUs, not meaningful)" : "");
+    return 0;
+}
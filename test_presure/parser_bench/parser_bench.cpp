@@ -0,0 +1,192 @@
+// 请求报文扫描对比测试：原来逐字节的parse_line + strncasecmp链 vs 向量化扫描 + 完美哈希
+// 两种做法都对真实浏览器请求的副本切分行、在'\r\n'处写'\0'、找到冒号并识别字段名，与http_conn的parse_line/parse_header相同
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include "../../http/http_scan.h"
+
+// 浏览器实际发出的请求报文
+static const char *corpus[] = {
+    // Chrome打开页面
+    "GET /welcome.html HTTP/1.1\r\n"
+    "Host: 192.168.1.10:9006\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "sec-ch-ua: \"Not_A Brand\";v=\"8\", \"Chromium\";v=\"120\", \"Google Chrome\";v=\"120\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "sec-ch-ua-platform: \"Windows\"\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8,application/signed-exchange;v=b3;q=0.7\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Referer: http://192.168.1.10:9006/log.html\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n"
+    "If-None-Match: \"63eb70cc-3ed\"\r\n"
+    "If-Modified-Since: Tue, 14 Feb 2023 11:30:20 GMT\r\n"
+    "\r\n",
+    // Chrome加载图片
+    "GET /cat.jpg HTTP/1.1\r\n"
+    "Host: 192.168.1.10:9006\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Not_A Brand\";v=\"8\", \"Chromium\";v=\"120\", \"Google Chrome\";v=\"120\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+    "sec-ch-ua-platform: \"Windows\"\r\n"
+    "Accept: image/avif,image/webp,image/apng,image/svg+xml,image/*,*/*;q=0.8\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Dest: image\r\n"
+    "Referer: http://192.168.1.10:9006/cat.html\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n"
+    "\r\n",
+    // Firefox
+    "GET /homepage.html HTTP/1.1\r\n"
+    "Host: 192.168.1.10:9006\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Ubuntu; Linux x86_64; rv:121.0) Gecko/20100101 Firefox/121.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Language: zh-CN,zh;q=0.8,zh-TW;q=0.7,zh-HK;q=0.5,en-US;q=0.3,en;q=0.2\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-Site: none\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "\r\n",
+    // Safari拖动视频进度条
+    "GET /xxx.mp4 HTTP/1.1\r\n"
+    "Host: 192.168.1.10:9006\r\n"
+    "Accept: */*\r\n"
+    "Accept-Language: zh-CN,zh-Hans;q=0.9\r\n"
+    "Connection: keep-alive\r\n"
+    "Range: bytes=1048576-\r\n"
+    "Accept-Encoding: identity\r\n"
+    "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.1 Safari/605.1.15\r\n"
+    "Referer: http://192.168.1.10:9006/video.html\r\n"
+    "\r\n",
+    // 登录表单
+    "POST /2CGISQL.cgi HTTP/1.1\r\n"
+    "Host: 192.168.1.10:9006\r\n"
+    "Connection: keep-alive\r\n"
+    "Content-Length: 27\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Origin: http://192.168.1.10:9006\r\n"
+    "Content-Type: application/x-www-form-urlencoded\r\n"
+    "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8\r\n"
+    "Referer: http://192.168.1.10:9006/1\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: zh-CN,zh;q=0.9\r\n"
+    "\r\n",
+    // curl
+    "GET / HTTP/1.1\r\n"
+    "Host: 127.0.0.1:9006\r\n"
+    "User-Agent: curl/8.5.0\r\n"
+    "Accept: */*\r\n"
+    "\r\n",
+};
+static const int CORPUS_SIZE = sizeof(corpus) / sizeof(corpus[0]);
+
+// 原来的做法：逐字节查找'\r'，字段名依次strncasecmp，与改动前的parse_line和parse_header相同
+static int parse_bytewise(char *buf, int len) {
+    int found = 0, start = 0, checked = 0;
+    while (true) {
+        for (; checked < len; ++checked) {
+            if (buf[checked] == '\r' || buf[checked] == '\n') break;
+        }
+        if (checked + 1 >= len || buf[checked] != '\r' || buf[checked + 1] != '\n') return found;
+        buf[checked++] = '\0';
+        buf[checked++] = '\0';
+        char *text = buf + start;
+        start = checked;
+        if (text[0] == '\0') return found;
+        if (strncasecmp(text, "Host:", 5) == 0) found += 1;
+        else if (strncasecmp(text, "Content-Length:", 15) == 0) found += 2;
+        else if (strncasecmp(text, "Range:", 6) == 0) found += 3;
+        else if (strncasecmp(text, "If-Range:", 9) == 0) found += 4;
+        else if (strncasecmp(text, "If-None-Match:", 14) == 0) found += 5;
+        else if (strncasecmp(text, "If-Modified-Since:", 18) == 0) found += 6;
+        else if (strncasecmp(text, "Accept-Encoding:", 16) == 0) found += 7;
+        else if (strncasecmp(text, "Connection:", 11) == 0) found += 8;
+    }
+}
+
+// 现在的做法：scan跳到'\r'，再scan到冒号，完美哈希识别字段名
+static int parse_vector(char *buf, int len, scan_fn scan) {
+    static const int weight[HDR_COUNT] = {1, 8, 2, 0, 0, 0, 3, 4, 5, 6, 0, 0, 0, 7};
+    int found = 0, start = 0, checked = 0;
+    while (true) {
+        checked = scan(buf + checked, buf + len, '\r', '\n') - buf;
+        if (checked + 1 >= len || buf[checked] != '\r' || buf[checked + 1] != '\n') return found;
+        buf[checked++] = '\0';
+        buf[checked++] = '\0';
+        char *text = buf + start;
+        start = checked;
+        if (text[0] == '\0') return found;
+        const char *colon = scan(text, buf + checked, ':', '\0');
+        header_id id = *colon == ':' ? lookup_header(text, colon - text) : HDR_UNKNOWN;
+        if (id != HDR_UNKNOWN) found += weight[id];
+    }
+}
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main() {
+    const int rounds = 200000;
+    static char bufs[CORPUS_SIZE][2048];
+    int lens[CORPUS_SIZE];
+    long bytes = 0;
+    for (int i = 0; i < CORPUS_SIZE; ++i) {
+        lens[i] = strlen(corpus[i]);
+        bytes += lens[i];
+    }
+
+    const char *names[] = {"bytewise+strncasecmp", "scalar+hash", "sse4.2+hash", "avx2+hash"};
+    scan_fn impls[] = {NULL, scan_any_scalar, scan_any_sse42, scan_any_avx2};
+    __builtin_cpu_init();
+    bool supported[] = {true, true, (bool)__builtin_cpu_supports("sse4.2"), (bool)__builtin_cpu_supports("avx2")};
+    printf("corpus: %d requests, %.0f bytes on average, server selects %s\n", CORPUS_SIZE, (double)bytes / CORPUS_SIZE, scan_impl_name());
+
+    // 解析会写入'\0'，每次都在副本上解析，先单独测出复制的耗时，再从结果中减去
+    double start = now_ns();
+    for (int r = 0; r < rounds; ++r) {
+        for (int i = 0; i < CORPUS_SIZE; ++i) {
+            memcpy(bufs[i], corpus[i], lens[i]);
+            __asm__ __volatile__("" : : "r"(bufs[i]) : "memory");
+        }
+    }
+    double copy_ns = now_ns() - start;
+
+    int expect = -1;
+    for (int k = 0; k < 4; ++k) {
+        if (!supported[k]) {
+            printf("%-22s not supported by this CPU\n", names[k]);
+            continue;
+        }
+        int check = 0;
+        start = now_ns();
+        for (int r = 0; r < rounds; ++r) {
+            for (int i = 0; i < CORPUS_SIZE; ++i) {
+                memcpy(bufs[i], corpus[i], lens[i]);
+                check += k ? parse_vector(bufs[i], lens[i], impls[k]) : parse_bytewise(bufs[i], lens[i]);
+            }
+        }
+        double ns = now_ns() - start - copy_ns;
+        // 各实现识别出的字段应当相同
+        if (expect == -1) expect = check;
+        printf("%-22s %8.1f ns/request  %6.2f GB/s%s\n", names[k], ns / rounds / CORPUS_SIZE,
+               (double)bytes * rounds / ns, check == expect ? "" : "  MISMATCH");
+    }
+    return 0;
+}
@@ -0,0 +1,131 @@
+// 线程池工作队列的对比测试
+// list_queue为原来threadpool中的实现（list + 互斥锁 + 信号量），与无锁环形队列mpmc_queue比较
+// 一个生产者线程模拟主线程，按批append任务，8~64个工作线程取任务，统计任务从入队到出队的延迟
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <vector>
+#include <algorithm>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "../../lock/locker.h"
+#include "../../threadpool/mpmc_queue.h"
+
+#define TASKS 200000        // 每轮入队的任务总数
+#define BATCH 16            // 每批入队的任务数，批与批之间间隔BATCH_GAP_US微秒，模拟一次epoll_wait返回多个就绪连接
+#define BATCH_GAP_US 20
+#define QUEUE_SIZE 10000    // 与threadpool默认的max_request相同
+
+struct task {
+    long enqueue_ns;
+};
+
+static long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// 原threadpool中的请求队列
+template<typename T>
+class list_queue {
+public:
+    list_queue(int max_request) : m_max_request(max_request) {}
+    bool push(T *request) {
+        m_queuelocker.lock();
+        if ((int)m_workqueue.size() >= m_max_request) {
+            m_queuelocker.unlock();
+            return false;
+        }
+        m_workqueue.push_back(request);
+        m_queuelocker.unlock();
+        m_queuestat.post();
+        return true;
+    }
+    T* pop() {
+        while (true) {
+            m_queuestat.wait();
+            m_queuelocker.lock();
+            if (m_workqueue.empty()) {
+                m_queuelocker.unlock();
+                continue;
+            }
+            T *request = m_workqueue.front();
+            m_workqueue.pop_front();
+            m_queuelocker.unlock();
+            return request;
+        }
+    }
+
+private:
+    int m_max_request;
+    std::list<T*> m_workqueue;
+    locker m_queuelocker;
+    sem m_queuestat;
+};
+
+template<typename Q>
+struct bench_ctx {
+    Q *queue;
+    std::vector<long> *latency;     // 每个工作线程一份，避免加锁
+};
+
+template<typename Q>
+void* consumer(void *arg) {
+    bench_ctx<Q> *ctx = (bench_ctx<Q> *)arg;
+    while (true) {
+        task *t = ctx->queue->pop();
+        // 空任务表示结束
+        if (!t) break;
+        ctx->latency->push_back(now_ns() - t->enqueue_ns);
+    }
+    return NULL;
+}
+
+template<typename Q>
+void run(const char *name, int workers) {
+    Q queue(QUEUE_SIZE);
+    std::vector<task> tasks(TASKS);
+    std::vector<std::vector<long> > latency(workers);
+    std::vector<bench_ctx<Q> > ctx(workers);
+    std::vector<pthread_t> tids(workers);
+    for (int i = 0; i < workers; ++i) {
+        latency[i].reserve(TASKS);
+        ctx[i].queue = &queue;
+        ctx[i].latency = &latency[i];
+        pthread_create(&tids[i], NULL, consumer<Q>, &ctx[i]);
+    }
+
+    long start = now_ns();
+    int dropped = 0;
+    for (int i = 0; i < TASKS; ++i) {
+        tasks[i].enqueue_ns = now_ns();
+        if (!queue.push(&tasks[i])) ++dropped;
+        // 批与批之间睡眠，相当于主线程阻塞在epoll_wait上
+        if (i % BATCH == BATCH - 1) usleep(BATCH_GAP_US);
+    }
+    for (int i = 0; i < workers; ++i) {
+        while (!queue.push(NULL)) ;
+    }
+    for (int i = 0; i < workers; ++i) pthread_join(tids[i], NULL);
+    double secs = (now_ns() - start) / 1e9;
+
+    std::vector<long> all;
+    for (int i = 0; i < workers; ++i) all.insert(all.end(), latency[i].begin(), latency[i].end());
+    std::sort(all.begin(), all.end());
+    size_t n = all.size();
+    printf("%-12s workers=%-3d p50 %8.1f us  p99 %8.1f us  p99.9 %8.1f us  %.0f tasks/s  dropped %d\n",
+           name, workers, all[n / 2] / 1e3, all[n * 99 / 100] / 1e3, all[n * 999 / 1000] / 1e3, n / secs, dropped);
+}
+
+int main() {
+    int workers[] = {8, 16, 32, 64};
+    for (int i = 0; i < 4; ++i) {
+        run<list_queue<task> >("list_queue", workers[i]);
+        run<mpmc_queue<task> >("mpmc_queue", workers[i]);
+    }
+    return 0;
+}
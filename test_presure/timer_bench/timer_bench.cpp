@@ -0,0 +1,93 @@
+// 升序链表定时器与分层时间轮的对比测试
+// 分别在1k/10k/100k个定时器下测量添加、调整（模拟每次读写后顺延超时时间）、删除和批量到期的平均耗时
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <sys/time.h>
+#include "../../timer/lst_timer.h"
+#include "../../timer/time_wheel.h"
+
+#define OPS 10000           // 每轮添加/调整/删除的操作次数
+#define IDLE_TIMEOUT 15     // 与服务器相同，连接空闲3个TIMESLOT后超时
+
+static long g_fired = 0;
+
+static void bench_cb(client_data *) {
+    ++g_fired;
+}
+
+static double now_us() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1e6 + tv.tv_usec;
+}
+
+static util_timer* new_timer(client_data *data, time_t expire) {
+    util_timer *timer = new util_timer;
+    timer->user_data = data;
+    timer->cb_func = bench_cb;
+    timer->expire = expire;
+    data->timer = timer;
+    return timer;
+}
+
+// 模拟服务器的用法：n个连接的定时器分布在未来IDLE_TIMEOUT秒内，
+// 然后随机挑选连接顺延到cur+IDLE_TIMEOUT（即移到最后），再新建和关闭连接
+template <typename T>
+void run(const char *name, int n) {
+    std::vector<client_data> users(n + OPS);
+    time_t cur = time(NULL);
+    T *container = new T;
+
+    // 按超时时间从大到小建立，升序链表每次都插在头部，建立过程本身不计时
+    for (int i = n - 1; i >= 0; --i)
+        container->add_timer(new_timer(&users[i], cur + 1 + (time_t)i * IDLE_TIMEOUT / n));
+
+    srand(1);
+    double start = now_us();
+    for (int i = 0; i < OPS; ++i) {
+        util_timer *timer = users[rand() % n].timer;
+        timer->expire = cur + IDLE_TIMEOUT + 1;
+        container->adjust_timer(timer);
+    }
+    double adjust = (now_us() - start) * 1000 / OPS;
+
+    start = now_us();
+    for (int i = 0; i < OPS; ++i)
+        container->add_timer(new_timer(&users[n + i], cur + IDLE_TIMEOUT + 1));
+    double add = (now_us() - start) * 1000 / OPS;
+
+    start = now_us();
+    for (int i = 0; i < OPS; ++i) {
+        container->del_timer(users[n + i].timer);
+        users[n + i].timer = NULL;
+    }
+    double del = (now_us() - start) * 1000 / OPS;
+
+    // 把所有定时器改为已经超时，测量一次tick批量处理的耗时
+    for (int i = 0; i < n; ++i) {
+        users[i].timer->expire = cur - 1;
+        container->adjust_timer(users[i].timer);
+    }
+    g_fired = 0;
+    start = now_us();
+    container->tick();
+    double expire = (now_us() - start) * 1000 / n;
+
+    printf("%-16s n=%-7d add %9.1f ns  adjust %9.1f ns  del %7.1f ns  expire %7.1f ns  (fired %ld)\n",
+           name, n, add, adjust, del, expire, g_fired);
+    delete container;
+}
+
+int main() {
+    // tick中会写日志，先初始化为同步日志
+    Log::get_instance()->init("./timer_bench_log", 2000, 800000, 0);
+
+    int sizes[] = {1000, 10000, 100000};
+    for (int i = 0; i < 3; ++i) {
+        run<sort_timer_lst>("sort_timer_lst", sizes[i]);
+        run<time_wheel>("time_wheel", sizes[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,189 @@
+#ifndef MPMC_QUEUE_H
+#define MPMC_QUEUE_H
+
+#include <atomic>
+#include <exception>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include "../lock/locker.h"
+using namespace std;
+
+#define MPMC_CACHELINE 64
+#define MPMC_MAX_SPIN 4000      // 空闲工作线程park前最多自旋的次数
+#define MPMC_MIN_SPIN 16        // 多核机器上自旋次数的下限，保证落空后还有机会重新加长
+
+// 有界多生产者多消费者无锁环形队列（Dmitry Vyukov的算法），取代线程池中的list + 互斥锁
+// 每个槽带一个序号，生产者和消费者各自用CAS抢占入队/出队位置，再通过槽的序号交接数据，入队出队都不需要加锁，也没有堆分配
+// 空闲的消费者先自旋一段时间，取不到任务再park在信号量上，生产者只在有消费者park时才post，忙时没有futex系统调用
+template<typename T>
+class mpmc_queue {
+public:
+    // 容量向上取整为2的幂
+    mpmc_queue(int capacity) : m_enqueue_pos(0), m_dequeue_pos(0), m_sleepers(0) {
+        if (capacity <= 0) throw exception();
+        m_capacity = 1;
+        while (m_capacity < (size_t)capacity) m_capacity <<= 1;
+        m_mask = m_capacity - 1;
+        m_cells = new cell[m_capacity];
+        for (size_t i = 0; i < m_capacity; ++i) {
+            m_cells[i].sequence.store(i, memory_order_relaxed);
+        }
+        // 单核机器上自旋只会抢占生产者的时间片，直接park
+        m_spin_min = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? MPMC_MIN_SPIN : 0;
+        m_spin_limit = m_spin_min ? MPMC_MAX_SPIN / 4 : 0;
+    }
+    ~mpmc_queue() {
+        delete[] m_cells;
+    }
+
+    // 入队，队列满时返回false，stamp随任务一起保存，线程池用它记录入队时间
+    bool push(T *item, long stamp = 0) {
+        cell *c;
+        size_t pos = m_enqueue_pos.load(memory_order_relaxed);
+        while (true) {
+            c = &m_cells[pos & m_mask];
+            size_t seq = c->sequence.load(memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            // 序号等于位置说明槽是空的，抢占该位置
+            if (diff == 0) {
+                if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                // 槽中的数据还没被取走，队列已满
+                return false;
+            } else {
+                pos = m_enqueue_pos.load(memory_order_relaxed);
+            }
+        }
+        c->data = item;
+        c->stamp = stamp;
+        c->sequence.store(pos + 1, memory_order_release);
+
+        // 与消费者park前的检查配对，二者至少有一方能看到对方
+        atomic_thread_fence(memory_order_seq_cst);
+        if (claim_sleeper()) m_park.post();
+        return true;
+    }
+
+    // 队列中任务数的近似值，只用于判断队列是否积压；先读出队位置，保证结果不为负
+    size_t size() const {
+        size_t head = m_dequeue_pos.load(memory_order_relaxed);
+        return m_enqueue_pos.load(memory_order_relaxed) - head;
+    }
+
+    // 非阻塞出队，队列空时返回false
+    bool try_pop(T *&item, long *stamp = NULL) {
+        cell *c;
+        size_t pos = m_dequeue_pos.load(memory_order_relaxed);
+        while (true) {
+            c = &m_cells[pos & m_mask];
+            size_t seq = c->sequence.load(memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            // 序号等于位置+1说明槽中有数据
+            if (diff == 0) {
+                if (m_dequeue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = m_dequeue_pos.load(memory_order_relaxed);
+            }
+        }
+        item = c->data;
+        if (stamp) *stamp = c->stamp;
+        // 槽的序号推进一圈，供下一轮的生产者使用
+        c->sequence.store(pos + m_mask + 1, memory_order_release);
+        return true;
+    }
+
+    // 阻塞出队，先自旋再park
+    T* pop() {
+        T *item;
+        pop(item, -1, NULL);
+        return item;
+    }
+
+    // 阻塞出队，timeout_ms为park的最长时间，为负时一直等待，超时仍取不到任务时返回false
+    // 自旋次数是自适应的：自旋期间取到任务就加长，自旋落空只能park就缩短
+    bool pop(T *&item, int timeout_ms, long *stamp) {
+        struct timespec abstime;
+        if (timeout_ms >= 0) {
+            clock_gettime(CLOCK_REALTIME, &abstime);
+            abstime.tv_sec += timeout_ms / 1000;
+            abstime.tv_nsec += (timeout_ms % 1000) * 1000000L;
+            if (abstime.tv_nsec >= 1000000000L) {
+                ++abstime.tv_sec;
+                abstime.tv_nsec -= 1000000000L;
+            }
+        }
+        while (true) {
+            int limit = m_spin_limit.load(memory_order_relaxed);
+            for (int i = 0; i < limit; ++i) {
+                if (try_pop(item, stamp)) {
+                    if (limit < MPMC_MAX_SPIN) m_spin_limit.store(limit + limit / 8 + 1, memory_order_relaxed);
+                    return true;
+                }
+                cpu_relax();
+            }
+            if (try_pop(item, stamp)) return true;
+            if (limit > m_spin_min) m_spin_limit.store(limit - limit / 8 - 1, memory_order_relaxed);
+
+            // 先登记再检查一次，避免生产者在登记前入队而错过唤醒
+            m_sleepers.fetch_add(1);
+            atomic_thread_fence(memory_order_seq_cst);
+            if (try_pop(item, stamp)) {
+                // 若登记已被生产者认领，信号量中会多出一次post，只会造成一次多余的唤醒
+                claim_sleeper();
+                return true;
+            }
+            if (timeout_ms < 0) {
+                m_park.wait();
+            } else if (!m_park.timedwait(&abstime)) {
+                // 超时后撤销登记；撤销失败说明生产者已经认领并post，取走这次post后再试一轮
+                if (claim_sleeper()) return false;
+                m_park.wait();
+            }
+        }
+    }
+
+private:
+    // 认领一个park的消费者，成功时由调用者负责post
+    bool claim_sleeper() {
+        int s = m_sleepers.load(memory_order_relaxed);
+        while (s > 0) {
+            if (m_sleepers.compare_exchange_weak(s, s - 1)) return true;
+        }
+        return false;
+    }
+
+    static void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        asm volatile("yield");
+#endif
+    }
+
+private:
+    struct cell {
+        atomic<size_t> sequence;
+        T *data;
+        long stamp;
+    };
+
+    // 入队位置和出队位置分别由生产者和消费者修改，放在不同的缓存行上避免伪共享
+    char m_pad0[MPMC_CACHELINE];
+    cell *m_cells;
+    size_t m_capacity;
+    size_t m_mask;
+    char m_pad1[MPMC_CACHELINE];
+    atomic<size_t> m_enqueue_pos;
+    char m_pad2[MPMC_CACHELINE];
+    atomic<size_t> m_dequeue_pos;
+    char m_pad3[MPMC_CACHELINE];
+    atomic<int> m_sleepers;         // park在信号量上的消费者个数
+    atomic<int> m_spin_limit;       // 当前的自旋次数
+    int m_spin_min;                 // 自旋次数的下限，单核机器上为0，即不自旋
+    sem m_park;
+};
+
+#endif
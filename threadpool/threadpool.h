@@ -1,59 +1,131 @@
 #ifndef THREADPOOL_H
 #define THREADPOOL_H
 
-#include <list>
 #include <cstdio>
 #include <exception>
+#include <atomic>
 #include <pthread.h>
+#include <time.h>
 #include "../lock/locker.h"
-#include "../CGI_MySQL/sql_connection_pool.h"
+#include "../log/log.h"
+#include "mpmc_queue.h"
 using namespace std;
 
+#define STEAL_SPIN 64       // 工作窃取模式下，工作线程park前轮询本地队列和窃取的次数
+#define GROW_INTERVAL_US 10000  // 弹性模式下两次扩容之间的最短间隔，避免一次突发中所有线程同时扩容
+
+// 调度方式
+enum SCHED_MODE {
+    SCHED_SHARED = 0,       // 所有工作线程共用一个请求队列
+    SCHED_STEALING          // 每个工作线程一个本地队列，空闲时随机挑选其他线程窃取任务
+};
+
 // 定义线程池模板类
 template<typename T>
 class threadpool {
 public:
     // thread_number是线程池中线程的数量，默认8，max_requests是请求队列中最多允许的、等待处理的请求的数量，默认10000
-    threadpool(connection_pool *connPool, int thread_number = 8, int max_request = 10000);
+    // sched为调度方式，工作窃取模式下max_request平均分给各个工作线程的本地队列
+    threadpool(int thread_number = 8, int max_request = 10000, SCHED_MODE sched = SCHED_SHARED);
     ~threadpool();
-    bool append(T *request);
+    // hint为任务希望交给的工作线程，一般传连接的sockfd，同一连接上的请求总落在同一个工作线程上，http_conn留在该核的缓存中
+    // 共用队列模式下忽略hint，hint为负时轮流分配
+    bool append(T *request, int hint = -1);
+
+    // 开启弹性线程数，只支持共用队列模式：任务在队列中的等待时间超过target_wait_us时增加一个线程，不超过max_thread；
+    // 线程空闲idle_ms毫秒后退出，不少于min_thread。扩容和缩容都会写入日志
+    bool set_elastic(int min_thread, int max_thread, int target_wait_us = 2000, int idle_ms = 30000);
+    // 当前的线程数，以及累计扩容、缩容的次数
+    int thread_count() const {return m_live;}
+    int grow_count() const {return m_grows;}
+    int shrink_count() const {return m_shrinks;}
 
 private:
+    // 工作窃取模式下每个工作线程的上下文
+    struct worker_ctx {
+        threadpool *pool;
+        int id;
+        mpmc_queue<T> *queue;       // 本地队列，事件循环往里放，本线程和窃取者从里面取
+        std::atomic<bool> parked;   // 本线程是否park在信号量上
+        sem park;
+        unsigned seed;              // 挑选窃取对象用的随机数种子
+    };
+
     // 工作线程运行的函数，它不断从工作队列中取出任务并执行之
     // 这两个函数定义为private，是因为在构造函数中就被pthread_create初始化，且worker函数中调用run，保证封装性
     // 而worker定义为static是防止非静态成员函数自动传入this指针作为arg默认参数，而静态成员函数没有this指针
     static void* worker(void *arg);
     void run();
+    // 工作窃取模式的线程函数，参数为worker_ctx指针
+    static void* stealing_worker(void *arg);
+    void run_stealing(worker_ctx *ctx);
+    // 依次尝试本地队列和随机挑选的其他工作线程的本地队列
+    T* take(worker_ctx *ctx);
+    // 唤醒一个park的工作线程（不含skip），让它去窃取积压的任务
+    void wake_thief(worker_ctx *skip);
+    // 处理请求，数据库连接只在需要的请求中由T自己获取
+    void process_request(T *request);
+    // 弹性模式下的扩容和缩容，缩容成功时调用者所在的线程退出
+    void try_grow(long wait_us);
+    bool try_shrink();
+    static long now_us();
 
 private:
     int m_thread_number;            // 定义线程池中的线程数
     int m_max_request;              // 定义请求队列中允许的最大请求数
     pthread_t *m_threads;           // 定义线程池的数组，大小为m_thread_number
-    list<T*> m_workqueue;           // 定义请求队列
-    locker m_queuelocker;           // 保护请求队列不被其他线程访问的互斥锁
-    sem m_queuestat;                // 定义请求队列中的请求任务信号量
-    bool m_stop;                    // 是否结束线程
-    connection_pool *m_connPool;    // 指向数据库池的数组
+    mpmc_queue<T> m_workqueue;      // 定义请求队列，无锁环形队列，空闲的工作线程先自旋再park在队列内部的信号量上
+    SCHED_MODE m_sched;             // 调度方式
+    worker_ctx *m_workers;          // 工作窃取模式下各工作线程的上下文，共用队列模式下为NULL
+    std::atomic<int> m_parked;      // 工作窃取模式下park的工作线程数
+    std::atomic<unsigned> m_next;   // 没有hint时轮流分配的下标
+    bool m_elastic;                 // 是否开启弹性线程数
+    int m_min_thread;
+    int m_max_thread;
+    int m_target_wait_us;           // 排队时间超过该值时扩容
+    int m_idle_ms;                  // 线程空闲超过该时间后缩容
+    std::atomic<int> m_live;        // 当前存活的工作线程数
+    std::atomic<long> m_last_grow;  // 上次扩容的时间
+    std::atomic<int> m_grows;
+    std::atomic<int> m_shrinks;
+    std::atomic<bool> m_stop;       // 是否结束线程，析构时在主线程中设置
 };
 
 // 注意这里报错了，因为在构造函数的形参列表中不能再有默认参数 int thread_number = 8, int max_request = 10000 了
 template<typename T>
-threadpool<T>::threadpool(connection_pool *connPool, int thread_number, int max_request) : 
-m_connPool(connPool), m_thread_number(thread_number), m_max_request(max_request), m_threads(NULL), m_stop(false) {
+threadpool<T>::threadpool(int thread_number, int max_request, SCHED_MODE sched) : 
+m_thread_number(thread_number), m_max_request(max_request), m_threads(NULL),
+m_workqueue(sched == SCHED_SHARED ? max_request : 1), m_sched(sched), m_workers(NULL), m_parked(0), m_next(0),
+m_elastic(false), m_min_thread(thread_number), m_max_thread(thread_number), m_target_wait_us(0), m_idle_ms(0),
+m_live(thread_number), m_last_grow(0), m_grows(0), m_shrinks(0), m_stop(false) {
     if (m_thread_number <= 0 || m_max_request <= 0) throw exception();
     // 初始化线程池数组，大小为m_thread_number，如果为NULL，抛出错误
     m_threads = new pthread_t[m_thread_number];
     if (!m_threads) throw exception();
+    if (m_sched == SCHED_STEALING) {
+        m_workers = new worker_ctx[m_thread_number];
+        int local = (m_max_request + m_thread_number - 1) / m_thread_number;
+        for (int i = 0; i < m_thread_number; ++i) {
+            m_workers[i].pool = this;
+            m_workers[i].id = i;
+            m_workers[i].queue = new mpmc_queue<T>(local);
+            m_workers[i].parked = false;
+            m_workers[i].seed = i + 1;
+        }
+    }
     // 循环创建线程，工作函数设为worker，参数传入成员对象this指针，随后将工作线程分离，不必对线程单独进行回收
+    // 工作窃取模式的线程数固定，不分离，析构时回收后才能释放它们使用的本地队列
     for (int i = 0; i < m_thread_number; ++i) {
         printf("create the %dth thread\n", i);
         // 注意这里不能写成 m_threads[i] 不存在这种转换形式，会报错
-        if (pthread_create(m_threads + i, NULL, worker, this) != 0) {
+        int ret = m_sched == SCHED_STEALING ? pthread_create(m_threads + i, NULL, stealing_worker, m_workers + i)
+                                            : pthread_create(m_threads + i, NULL, worker, this);
+        if (ret != 0) {
             // 注意当创建/分离出错时，要释放线程池空间，避免内存泄漏
             delete[] m_threads;
             throw exception();
         }
-        if (pthread_detach(m_threads[i]) != 0) {
+        if (m_sched != SCHED_STEALING && pthread_detach(m_threads[i]) != 0) {
             delete[] m_threads;
             throw exception();  
         }
@@ -62,27 +134,108 @@ m_connPool(connPool), m_thread_number(thread_number), m_max_request(max_request)
 
 template<typename T>
 threadpool<T>::~threadpool() {
-    delete[] m_threads;
     m_stop = true;
+    if (m_sched == SCHED_STEALING) {
+        // park的线程醒来后检查m_stop退出，正在自旋或处理请求的线程会在下一轮循环中退出
+        for (int i = 0; i < m_thread_number; ++i) m_workers[i].park.post();
+        for (int i = 0; i < m_thread_number; ++i) pthread_join(m_threads[i], NULL);
+        // 工作线程都已退出，不会再访问本地队列，队列中剩下的请求随之丢弃
+        for (int i = 0; i < m_thread_number; ++i) delete m_workers[i].queue;
+        delete[] m_workers;
+    }
+    delete[] m_threads;
 }
 
 template<typename T>
-bool threadpool<T>::append(T *request) {
-    // 进入工作队列前先加锁，防止其他线程同时访问工作队列
-    m_queuelocker.lock();
-    if (m_workqueue.size() >= m_max_request) {
+bool threadpool<T>::append(T *request, int hint) {
+    if (m_sched == SCHED_STEALING) {
+        unsigned idx = hint < 0 ? m_next++ : hint;
+        // 目标线程的本地队列满时依次放入其他线程的本地队列，只损失这一个请求的缓存亲和性，所有本地队列都满时才拒绝
+        for (int i = 0; i < m_thread_number; ++i) {
+            worker_ctx *ctx = m_workers + (idx + i) % m_thread_number;
+            if (!ctx->queue->push(request)) continue;
+            // 与工作线程park前的检查配对；目标线程没有park时，本地队列只有这一个任务就留给它处理完手头的请求后取走，
+            // 已经积压时再唤醒一个park的线程来窃取，否则park的线程永远不会去窃取，积压的任务只能等目标线程逐个处理
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (ctx->parked.load(std::memory_order_relaxed) && ctx->parked.exchange(false)) {
+                --m_parked;
+                ctx->park.post();
+            } else if (m_parked.load(std::memory_order_relaxed) > 0 && ctx->queue->size() > 1) {
+                wake_thief(ctx);
+            }
+            return true;
+        }
+        printf("Workqueue is full now, please wait\n");
+        LOG_WARN("all local workqueues are full, %d threads", m_thread_number);
+        return false;
+    }
+    // 无锁入队，队列中有m_max_request（向上取整为2的幂）个槽，有工作线程park时由队列负责唤醒
+    // 弹性模式下同时记录入队时间，工作线程取出时据此计算排队时间
+    if (!m_workqueue.push(request, m_elastic ? now_us() : 0)) {
         printf("Workqueue is full now, please wait\n");
-        // 改动1
-        m_queuelocker.unlock();
+        LOG_WARN("workqueue is full, %d threads", (int)m_live);
+        // 队列已满说明线程数明显不够，直接尝试扩容
+        if (m_elastic) try_grow(-1);
         return false;
     }
-    // 加入新的任务后解锁，并将信号量+1，提示有任务需要处理
-    m_workqueue.push_back(request);
-    m_queuelocker.unlock();
-    m_queuestat.post();
     return true;
 }
 
+template<typename T>
+bool threadpool<T>::set_elastic(int min_thread, int max_thread, int target_wait_us, int idle_ms) {
+    if (m_sched != SCHED_SHARED || min_thread <= 0 || max_thread < min_thread || target_wait_us <= 0 || idle_ms <= 0) return false;
+    m_min_thread = min_thread;
+    m_max_thread = max_thread;
+    m_target_wait_us = target_wait_us;
+    m_idle_ms = idle_ms;
+    m_elastic = true;
+    LOG_INFO("threadpool elastic: %d threads, min %d, max %d, target wait %d us, idle %d ms",
+             (int)m_live, min_thread, max_thread, target_wait_us, idle_ms);
+    return true;
+}
+
+template<typename T>
+long threadpool<T>::now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+template<typename T>
+void threadpool<T>::try_grow(long wait_us) {
+    int live = m_live;
+    if (live >= m_max_thread) return;
+    // 限制扩容频率，只有抢到本次扩容机会的线程继续
+    long now = now_us();
+    long last = m_last_grow;
+    if (now - last < GROW_INTERVAL_US || !m_last_grow.compare_exchange_strong(last, now)) return;
+    if (!m_live.compare_exchange_strong(live, live + 1)) return;
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, worker, this) != 0) {
+        --m_live;
+        LOG_ERROR("%s", "threadpool grow failure");
+        return;
+    }
+    pthread_detach(tid);
+    ++m_grows;
+    if (wait_us < 0) LOG_INFO("threadpool grow to %d threads, workqueue full", live + 1);
+    else LOG_INFO("threadpool grow to %d threads, queue wait %ld us", live + 1, wait_us);
+}
+
+template<typename T>
+bool threadpool<T>::try_shrink() {
+    int live = m_live;
+    while (live > m_min_thread) {
+        if (m_live.compare_exchange_weak(live, live - 1)) {
+            ++m_shrinks;
+            LOG_INFO("threadpool shrink to %d threads, idle %d ms", live - 1, m_idle_ms);
+            return true;
+        }
+    }
+    return false;
+}
+
 // 静态成员函数定义的时候就不用加static关键字了
 template<typename T>
 void* threadpool<T>::worker(void *arg) {
@@ -92,37 +245,91 @@ void* threadpool<T>::worker(void *arg) {
     return pool;    // 记得返回pool指针
 }
 
+template<typename T>
+void* threadpool<T>::stealing_worker(void *arg) {
+    worker_ctx *ctx = (worker_ctx*) arg;
+    ctx->pool->run_stealing(ctx);
+    return ctx->pool;
+}
+
+template<typename T>
+T* threadpool<T>::take(worker_ctx *ctx) {
+    T *request;
+    if (ctx->queue->try_pop(request)) return request;
+    // 从随机的起点开始依次尝试其他工作线程的本地队列，避免所有窃取者都挤在同一个对象上
+    ctx->seed = ctx->seed * 1103515245 + 12345;
+    int start = (ctx->seed >> 16) % m_thread_number;
+    for (int i = 0; i < m_thread_number; ++i) {
+        worker_ctx *victim = m_workers + (start + i) % m_thread_number;
+        if (victim != ctx && victim->queue->try_pop(request)) return request;
+    }
+    return NULL;
+}
+
+template<typename T>
+void threadpool<T>::wake_thief(worker_ctx *skip) {
+    for (int i = 1; i < m_thread_number; ++i) {
+        worker_ctx *w = m_workers + (skip->id + i) % m_thread_number;
+        // 清除标记成功的一方负责post，与append和工作线程自己撤销park互斥
+        if (w->parked.load(std::memory_order_relaxed) && w->parked.exchange(false)) {
+            --m_parked;
+            w->park.post();
+            return;
+        }
+    }
+}
+
+template<typename T>
+void threadpool<T>::run_stealing(worker_ctx *ctx) {
+    while (!m_stop) {
+        T *request = NULL;
+        for (int i = 0; i < STEAL_SPIN && !request; ++i) request = take(ctx);
+        if (!request) {
+            // 先标记park再检查一次本地队列，避免append在标记前入队而错过唤醒
+            ctx->parked = true;
+            ++m_parked;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!ctx->queue->try_pop(request)) {
+                ctx->park.wait();
+                continue;
+            }
+            // 标记若已被append清除，信号量中会多出一次post，只会造成一次多余的唤醒
+            if (ctx->parked.exchange(false)) --m_parked;
+        }
+        if (!request) continue;
+        process_request(request);
+    }
+}
+
+template<typename T>
+void threadpool<T>::process_request(T *request) {
+    // 不再为每个请求都从连接池取出数据库连接，静态文件请求不会阻塞在连接池的信号量上，
+    // 只有注册请求在do_request中按需获取，见http_conn::do_request
+    request->process();
+}
+
 template<typename T>
 void threadpool<T>::run() {
     // 当未结束进程时，进入循环体
     while (!m_stop) {
-        // 注意下面两句话的顺序不能颠倒！
-        // 因为如果先对工作队列加锁，再信号量-1时，如果此时队列为空，信号量无法-1
-        // 则需要等待调用append函数+1，而append中需要对locker解锁，进而形成死锁
-        m_queuestat.wait();     // 先对工作队列任务数-1，如果队列为空，等待append添加任务即可
-        m_queuelocker.lock();   // 再对工作队列加锁
-        if (m_workqueue.empty()) {
-            // 如果队列为空，解锁继续等待  （其实我觉得队列不会为空？）
-            m_queuelocker.unlock();
-            continue;
+        T *request;
+        if (m_elastic) {
+            long stamp;
+            // 空闲超过m_idle_ms仍取不到任务，线程数多于下限时本线程退出
+            if (!m_workqueue.pop(request, m_idle_ms, &stamp)) {
+                if (try_shrink()) break;
+                continue;
+            }
+            long wait = stamp ? now_us() - stamp : 0;
+            if (wait > m_target_wait_us) try_grow(wait);
+        } else {
+            // 取出一个任务，队列为空时先自旋，再park等待append唤醒
+            request = m_workqueue.pop();
         }
-        // 若为空，从队头弹出待处理的任务并解锁
-        T *request = m_workqueue.front();
-        m_workqueue.pop_front();
-        m_queuelocker.unlock();
         // 若request为空，继续循环，否则取出数据库池中的一个连接
         if (!request) continue;
 
-        // 改动2 这里网站上代码好像和源代码不一样
-        connectionRAII mysqlcon(&request->m_mysql, m_connPool);
-        
-        request->process();
-
-        // request->m_mysql = m_connPool->GetConnection();
-        // // 执行执行http中的process函数
-        // request->process();
-        // // 执行后将数据库连接放回数据库池中
-        // m_connPool->ReleaseConnection(request->m_mysql);
+        process_request(request);
     }
 }
 
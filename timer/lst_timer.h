@@ -3,6 +3,7 @@
 
 #include <time.h>
 #include <arpa/inet.h>
+#include <atomic>
 #include "../log/log.h"
 
 // 前向声明，client_data结构体中需要用到，注意定时器类和用户资源结构体互相绑定，各自包含！！！
@@ -12,14 +13,20 @@ struct client_data {
     // 客户端socket地址，其实这个变量没啥卵用，只在输出日志中用到过
     sockaddr_in address;
     int sockfd;
+    // 连接所属事件循环的内核事件表，定时器回调中用来注销该连接
+    int epollfd;
     // 定时器
     util_timer *timer;
+    // 最近一次有数据传输的时间，惰性刷新模式下读写只更新它，由时间轮在定时器到期时复查
+    time_t last_active;
+    // 连接在等待异步查询，此时连接上没有注册任何事件，定时器到期时顺延而不关闭；由工作线程设置，事件循环线程清除
+    std::atomic<bool> pending;
 };
 
 // 定时器设计
 class util_timer {
 public:
-    util_timer() : prev(NULL), next(NULL) {}
+    util_timer() : prev(NULL), next(NULL), slot(-1) {}
 
 public:
     // 超时时间
@@ -32,6 +39,8 @@ public:
     util_timer *prev;
     // 后继计时器
     util_timer *next;
+    // 所在时间轮槽的编号，只有time_wheel使用，-1表示不在时间轮中
+    int slot;
 };
 
 // 定时器容器设计
@@ -111,7 +120,12 @@ public:
         delete timer;
     }
 
-    // 定时任务处理函数，使用统一事件源，SIGALRM信号每次被触发，主循环中调用一次定时任务处理函数，处理链表容器中到期的定时器。
+    // 链表中最早的超时时间，即头节点的超时时间，链表为空时返回0，事件循环据此设置timerfd
+    time_t next_expire() const {
+        return head ? head->expire : 0;
+    }
+
+    // 定时任务处理函数，使用统一事件源，timerfd在最早的定时器到期时触发，主循环中调用一次定时任务处理函数，处理链表容器中到期的定时器。
     void tick() {
         if (!head) return ;
 
@@ -0,0 +1,184 @@
+#ifndef TIME_WHEEL
+#define TIME_WHEEL
+
+#include <string.h>
+#include <time.h>
+#include "lst_timer.h"
+
+#define TW_LEVELS 4                             // 时间轮层数
+#define TW_SLOT_BITS 6
+#define TW_SLOTS (1 << TW_SLOT_BITS)            // 每层的槽数，64
+#define TW_SLOT_MASK (TW_SLOTS - 1)
+#define TW_PENDING_RECHECK 5                    // 等待异步查询的连接到期后隔多久再检查，单位秒
+
+// 分层时间轮，接口与sort_timer_lst相同，定时器仍是util_timer，超时后同样调用其cb_func
+// 精度为1秒，第0层每个槽对应1秒，第L层每个槽对应64^L秒，4层共覆盖64^4秒（约194天），更远的定时器放在最高层，下沉时再重新放置
+// 添加、调整、删除都只是双向链表的插入和摘除，时间复杂度O(1)，与连接数无关
+// 每层用一个64位的位图记录非空的槽，求最早超时时间时不用逐个扫描槽
+// idle_timeout不为0时为惰性刷新模式：连接活跃时只更新client_data::last_active，不调整定时器，
+// 定时器到期时再复查，last_active + idle_timeout还没到就按它重新放置，否则才执行回调
+class time_wheel {
+public:
+    time_wheel(int idle_timeout = 0) : m_cur(time(NULL)), m_count(0), m_idle_timeout(idle_timeout) {
+        memset(m_slots, 0, sizeof(m_slots));
+        memset(m_bitmap, 0, sizeof(m_bitmap));
+    }
+    ~time_wheel() {
+        for (int i = 0; i < TW_LEVELS * TW_SLOTS; ++i) {
+            while (m_slots[i]) {
+                util_timer *tmp = m_slots[i];
+                m_slots[i] = tmp->next;
+                delete tmp;
+            }
+        }
+    }
+
+    // 添加定时器
+    void add_timer(util_timer *timer) {
+        if (!timer) return ;
+        // 时间轮为空时直接把当前时间拨到现在，避免空闲很久后tick要逐秒追赶
+        if (!m_count) m_cur = time(NULL);
+        ++m_count;
+        link(timer, slot_of(timer->expire));
+    }
+
+    // 调整定时器，超时时间变化后重新放置，仍落在原来的槽中时不用移动
+    void adjust_timer(util_timer *timer) {
+        if (!timer) return ;
+        int slot = slot_of(timer->expire);
+        if (slot == timer->slot) return ;
+        unlink(timer);
+        link(timer, slot);
+    }
+
+    // 删除定时器
+    void del_timer(util_timer *timer) {
+        if (!timer) return ;
+        unlink(timer);
+        --m_count;
+        delete timer;
+    }
+
+    // 最早可能有定时器到期的时间，时间轮为空时返回0，事件循环据此设置timerfd
+    // 第0层的槽给出精确的超时时间，更高层给出该槽下沉的时间，下沉后重新计算，因此只会提前不会推迟
+    time_t next_expire() const {
+        if (!m_count) return 0;
+        time_t expire = 0;
+        for (int level = 0; level < TW_LEVELS; ++level) {
+            unsigned long long bits = m_bitmap[level];
+            if (!bits) continue;
+            int shift = level * TW_SLOT_BITS;
+            // 第0层的当前槽尚未处理；更高层的当前槽只有m_cur恰好在其起点时才尚未下沉，否则从下一个槽开始找
+            time_t first = m_cur >> shift;
+            if (m_cur & ((1LL << shift) - 1)) ++first;
+            int start = first & TW_SLOT_MASK;
+            unsigned long long rotated = (bits >> start) | (start ? bits << (TW_SLOTS - start) : 0);
+            time_t t = (first + __builtin_ctzll(rotated)) << shift;
+            if (!expire || t < expire) expire = t;
+        }
+        return expire;
+    }
+
+    // 定时任务处理函数，timerfd到期时调用，逐秒推进时间轮到当前时间，到期的槽整批执行回调
+    void tick() {
+        if (!m_count) return ;
+
+        // 每秒都会调用，只在调试级别记一行，不再打印到标准输出，也不强制刷盘
+        LOG_DEBUG("%s", "timer tick");
+
+        // 不用time()：它读的是粗粒度时钟，timerfd在整秒到期后它还可能停在上一秒几毫秒，
+        // 这时tick什么也不做，重新设置的timerfd立即再次到期，事件循环空转到粗粒度时钟跟上为止
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        time_t cur_time = ts.tv_sec;
+        while (m_cur <= cur_time) {
+            // 第0层转完一圈时，把上一层对应槽中的定时器下沉，逐层向上
+            if (!(m_cur & TW_SLOT_MASK)) {
+                for (int level = 1; level < TW_LEVELS; ++level) {
+                    int idx = (m_cur >> (level * TW_SLOT_BITS)) & TW_SLOT_MASK;
+                    cascade(level * TW_SLOTS + idx);
+                    if (idx) break;
+                }
+            }
+            // 整批取下当前槽，逐个执行回调并释放
+            int slot = m_cur & TW_SLOT_MASK;
+            util_timer *tmp = m_slots[slot];
+            m_slots[slot] = NULL;
+            m_bitmap[0] &= ~(1ULL << slot);
+            while (tmp) {
+                util_timer *next = tmp->next;
+                if (tmp->user_data->pending) {
+                    // 关闭等待异步查询的连接会与查询完成后的处理冲突，顺延到查询完成以后
+                    tmp->expire = cur_time + TW_PENDING_RECHECK;
+                    link(tmp, slot_of(tmp->expire));
+                } else if (m_idle_timeout && tmp->user_data->last_active + m_idle_timeout > cur_time) {
+                    // 到期前又有数据传输，顺延到最后一次活跃后的idle_timeout秒，一个空闲周期内最多重新放置一次
+                    tmp->expire = tmp->user_data->last_active + m_idle_timeout;
+                    link(tmp, slot_of(tmp->expire));
+                } else {
+                    --m_count;
+                    tmp->cb_func(tmp->user_data);
+                    delete tmp;
+                }
+                tmp = next;
+            }
+            ++m_cur;
+        }
+    }
+
+private:
+    // 根据超时时间计算槽编号(层号*64+槽号)，已经超时的放入当前槽，下一次tick执行
+    int slot_of(time_t expire) const {
+        if (expire < m_cur) expire = m_cur;
+        time_t delta = expire - m_cur;
+        for (int level = 0; level < TW_LEVELS - 1; ++level) {
+            if (delta < (1LL << ((level + 1) * TW_SLOT_BITS)))
+                return level * TW_SLOTS + ((expire >> (level * TW_SLOT_BITS)) & TW_SLOT_MASK);
+        }
+        // 超出范围的放在最高层的最远处
+        int shift = (TW_LEVELS - 1) * TW_SLOT_BITS;
+        if (delta >= (1LL << (TW_LEVELS * TW_SLOT_BITS))) expire = m_cur + (1LL << (TW_LEVELS * TW_SLOT_BITS)) - 1;
+        return (TW_LEVELS - 1) * TW_SLOTS + ((expire >> shift) & TW_SLOT_MASK);
+    }
+
+    // 头插法放入槽中
+    void link(util_timer *timer, int slot) {
+        timer->slot = slot;
+        timer->prev = NULL;
+        timer->next = m_slots[slot];
+        if (m_slots[slot]) m_slots[slot]->prev = timer;
+        m_slots[slot] = timer;
+        m_bitmap[slot / TW_SLOTS] |= 1ULL << (slot & TW_SLOT_MASK);
+    }
+
+    void unlink(util_timer *timer) {
+        int slot = timer->slot;
+        if (timer->prev) timer->prev->next = timer->next;
+        else m_slots[slot] = timer->next;
+        if (timer->next) timer->next->prev = timer->prev;
+        if (!m_slots[slot]) m_bitmap[slot / TW_SLOTS] &= ~(1ULL << (slot & TW_SLOT_MASK));
+        timer->prev = timer->next = NULL;
+        timer->slot = -1;
+    }
+
+    // 把高层一个槽中的定时器按剩余时间重新放入低层
+    void cascade(int slot) {
+        util_timer *tmp = m_slots[slot];
+        m_slots[slot] = NULL;
+        m_bitmap[slot / TW_SLOTS] &= ~(1ULL << (slot & TW_SLOT_MASK));
+        while (tmp) {
+            util_timer *next = tmp->next;
+            link(tmp, slot_of(tmp->expire));
+            tmp = next;
+        }
+    }
+
+private:
+    time_t m_cur;                                   // 下一个要处理的秒，即第0层的当前槽
+    int m_count;                                    // 时间轮中的定时器个数
+    int m_idle_timeout;                             // 惰性刷新模式下的空闲超时时间，0表示不启用
+    util_timer *m_slots[TW_LEVELS * TW_SLOTS];
+    unsigned long long m_bitmap[TW_LEVELS];         // 每层非空槽的位图
+};
+
+#endif